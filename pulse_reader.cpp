@@ -0,0 +1,111 @@
+/*
+	Pulse reader client, dispatches to kernel module or gpiod backend
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#include "pulse_reader.h"
+#include "pulse_reader_gpiod.h"
+
+struct pulse_reader
+{
+	int backend;
+	int fd;//kernel backend
+	struct pulse_reader_gpiod_t *gpiod;//gpiod backend
+};
+
+pulse_reader_t *pulse_reader_open(int backend, const char *gpiod_chip)
+{
+	pulse_reader_t *reader;
+
+	reader = (pulse_reader_t *)calloc(1, sizeof(pulse_reader_t));
+	if(!reader)
+		return NULL;
+	reader->fd = -1;
+
+	if(backend == PULSE_READER_BACKEND_AUTO || backend == PULSE_READER_BACKEND_KERNEL) {
+		reader->fd = open("/dev/pulse_reader", O_RDWR);
+		if(reader->fd >= 0) {
+			reader->backend = PULSE_READER_BACKEND_KERNEL;
+			return reader;
+		}
+		//only fall back when the module isn't there, not on e.g. EACCES
+		if(backend == PULSE_READER_BACKEND_KERNEL
+			|| (errno != ENOENT && errno != ENODEV && errno != ENXIO)) {
+			free(reader);
+			return NULL;
+		}
+	}
+
+	//module not loaded or gpiod requested explicitly
+	reader->gpiod = pulse_reader_gpiod_open(gpiod_chip ? gpiod_chip : PULSE_READER_DEFAULT_CHIP);
+	if(!reader->gpiod) {
+		free(reader);
+		return NULL;
+	}
+	reader->backend = PULSE_READER_BACKEND_GPIOD;
+	return reader;
+}
+
+void pulse_reader_close(pulse_reader_t *reader)
+{
+	if(!reader)
+		return;
+	if(reader->backend == PULSE_READER_BACKEND_KERNEL)
+		close(reader->fd);
+	else
+		pulse_reader_gpiod_close(reader->gpiod);
+	free(reader);
+}
+
+int pulse_reader_backend(const pulse_reader_t *reader)
+{
+	return reader->backend;
+}
+
+int pulse_reader_add_io(pulse_reader_t *reader, const add_io_t *add_io)
+{
+	if(reader->backend == PULSE_READER_BACKEND_KERNEL)
+		return ioctl(reader->fd, ADD_IO, add_io) == -1 ? -1 : 0;
+	return pulse_reader_gpiod_add_io(reader->gpiod, add_io);
+}
+
+int pulse_reader_remove_io(pulse_reader_t *reader, uint32_t gpio)
+{
+	if(reader->backend == PULSE_READER_BACKEND_KERNEL)
+		return ioctl(reader->fd, REMOVE_IO, &gpio) == -1 ? -1 : 0;
+	return pulse_reader_gpiod_remove_io(reader->gpiod, gpio);
+}
+
+int pulse_reader_set_cal_period(pulse_reader_t *reader, uint32_t period)
+{
+	if(reader->backend == PULSE_READER_BACKEND_KERNEL)
+		return ioctl(reader->fd, SET_CAL_PERIOD, &period) == -1 ? -1 : 0;
+	return pulse_reader_gpiod_set_cal_period(reader->gpiod, period);
+}
+
+int pulse_reader_get_io_stat(pulse_reader_t *reader, get_io_stat_t *get_io_stat)
+{
+	if(reader->backend == PULSE_READER_BACKEND_KERNEL)
+		return ioctl(reader->fd, GET_IO_STAT, get_io_stat) == -1 ? -1 : 0;
+	return pulse_reader_gpiod_get_io_stat(reader->gpiod, get_io_stat);
+}
+
+int pulse_reader_get_io_stat_ext(pulse_reader_t *reader, io_stat_ext_t *stats, uint32_t n_ios)
+{
+	get_io_stat_ext_t req;
+
+	if(reader->backend != PULSE_READER_BACKEND_KERNEL)
+		return pulse_reader_gpiod_get_io_stat_ext(reader->gpiod, stats, n_ios);
+
+	req.size = sizeof(get_io_stat_ext_t);
+	req.stat_size = sizeof(io_stat_ext_t);
+	req.n_ios = n_ios;
+	req.reserved = 0;
+	req.stats = (uint64_t)(uintptr_t)stats;
+	return ioctl(reader->fd, GET_IO_STAT_EXT, &req) == -1 ? -1 : 0;
+}
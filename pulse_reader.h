@@ -0,0 +1,96 @@
+/*
+	Pulse reader client API
+
+	Wraps the /dev/pulse_reader ioctls so applications don't depend on
+	the kernel module being loaded. When the module is missing the same
+	calls are served by a userspace backend built on the GPIO character
+	device (libgpiod v2 edge events).
+ */
+
+#ifndef PULSE_READER_H
+#define PULSE_READER_H
+
+#include <stdint.h>
+
+#define	ADD_IO				0x7B01
+#define	REMOVE_IO			0x7B02
+#define	SET_CAL_PERIOD	0x7B03//set period in ms
+#define	GET_IO_STAT		0x7B04
+#define	GET_IO_STAT_EXT	0x7B05
+
+#define	DUTY_RATIO_SCALE	1000000//duty_ratio in ppm
+#define	IO_STAT_STOPPED	0x1//io_stat_ext_t flags
+#define	IO_STAT_NOT_FOUND	0x2//gpio was not added
+
+#define	MAX_IO_NUMBER	10
+
+//backend selection for pulse_reader_open
+#define	PULSE_READER_BACKEND_AUTO		0//kernel module if loaded, else gpiod
+#define	PULSE_READER_BACKEND_KERNEL	1
+#define	PULSE_READER_BACKEND_GPIOD		2
+
+#define	PULSE_READER_DEFAULT_CHIP		"/dev/gpiochip0"
+
+typedef struct
+{
+	uint32_t gpio;
+	uint32_t filter_win_size;
+} add_io_t;
+
+typedef struct
+{
+	uint32_t gpio;
+	uint32_t duty;//in nanosecond
+	uint32_t cycle;//in nanosecond
+} io_stat_user_t;
+
+typedef struct
+{
+	io_stat_user_t io_stat_user[MAX_IO_NUMBER];
+	uint32_t n_ios;
+} get_io_stat_t;
+
+//extended stat record, fields are only ever appended so binaries built
+//against an older header keep working, see GET_IO_STAT_EXT in module.c.
+//With a flag set only gpio and flags are valid, the rest is zero.
+typedef struct
+{
+	uint32_t gpio;
+	uint32_t flags;
+	uint64_t duty;//in nanosecond
+	uint64_t cycle;//in nanosecond
+	uint32_t duty_ratio;//duty/cycle in ppm
+	uint32_t frequency;//in mHz
+	uint64_t n_samples;//positive pulses since the channel was reset
+	uint64_t age;//nanoseconds since the last edge, 0 and meaningless when stopped
+} io_stat_ext_t;
+
+typedef struct
+{
+	uint32_t size;//sizeof(get_io_stat_ext_t)
+	uint32_t stat_size;//sizeof(io_stat_ext_t)
+	uint32_t n_ios;
+	uint32_t reserved;//must be 0
+	uint64_t stats;//pointer to n_ios records with gpio filled in
+} get_io_stat_ext_t;
+
+typedef struct pulse_reader pulse_reader_t;
+
+//gpiod_chip is only used by the gpiod backend, NULL means PULSE_READER_DEFAULT_CHIP.
+//gpio is the kernel gpio number with both backends, the gpiod backend
+//translates it with the chip base from /sys/class/gpio and only serves
+//lines of gpiod_chip. AUTO falls back to gpiod only when the module is not
+//loaded, other open errors are returned.
+pulse_reader_t *pulse_reader_open(int backend, const char *gpiod_chip);
+void pulse_reader_close(pulse_reader_t *reader);
+int pulse_reader_backend(const pulse_reader_t *reader);
+
+//all below return 0 on success, -1 and errno on failure, same as ioctl
+int pulse_reader_add_io(pulse_reader_t *reader, const add_io_t *add_io);
+int pulse_reader_remove_io(pulse_reader_t *reader, uint32_t gpio);
+int pulse_reader_set_cal_period(pulse_reader_t *reader, uint32_t period);
+int pulse_reader_get_io_stat(pulse_reader_t *reader, get_io_stat_t *get_io_stat);
+//stats[i].gpio selects the io, n_ios up to MAX_IO_NUMBER
+int pulse_reader_get_io_stat_ext(pulse_reader_t *reader, io_stat_ext_t *stats, uint32_t n_ios);
+
+#endif
@@ -0,0 +1,569 @@
+/*
+	Userspace pulse reader backend on top of libgpiod v2
+
+	Runs the same width/median pipeline as the kernel module, fed by the
+	kernel timestamps carried in GPIO character device edge events. One
+	worker thread reads the events of all lines in batches.
+ */
+
+#include <gpiod.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <algorithm>
+
+#include "pulse_reader_gpiod.h"
+
+//keep these in line with module.c
+#define	MAX_PULSE_WIDTH				30//in ms
+#define	MAX_FILTER_WINDOW_SIZE		48
+#define	MIN_FILTER_WINDOW_SIZE		1//no filter
+#define	MAX_CALCULATE_PERIOD		1000//in ms
+#define	MIN_CALCULATE_PERIOD		10
+#define	DEFALT_CALCULATE_PERIOD		10
+
+//number of edge events fetched per read
+#define	EVENT_BATCH_SIZE			64
+
+#define	NS_PER_MS					1000000ULL
+
+typedef struct
+{
+	uint32_t gpio;//kernel gpio number, same as the kernel backend
+	uint32_t offset;//line offset on the chip
+	uint32_t filter_win_size;
+	struct gpiod_line_request *request;
+	bool used;
+
+	//runtime stats
+	uint8_t level;
+	uint64_t pulse_p[MAX_FILTER_WINDOW_SIZE];//in ns
+	uint64_t pulse_n[MAX_FILTER_WINDOW_SIZE];
+	uint32_t index_p;
+	uint32_t index_n;
+	uint64_t last_edge;//timestamp of last edge
+	bool stopped;
+	uint64_t n_samples;
+} gpiod_io_stat_t;
+
+struct pulse_reader_gpiod_t
+{
+	struct gpiod_chip *chip;
+	uint32_t base;//kernel gpio number of line 0
+	uint32_t num_lines;
+	struct gpiod_edge_event_buffer *event_buffer;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int wake_pipe[2];//wakes the thread when the line set changes
+	bool running;
+
+	gpiod_io_stat_t io_stats[MAX_IO_NUMBER];
+	uint32_t calculate_period;//in ms
+};
+
+static uint64_t pulse_reader_gpiod_now(void)
+{
+	struct timespec ts;
+
+	//edge event timestamps are CLOCK_MONOTONIC, see pulse_reader_gpiod_add_io
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pulse_reader_gpiod_wake(struct pulse_reader_gpiod_t *p_data)
+{
+	char c = 0;
+
+	if(write(p_data->wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		perror("pulse_reader_gpiod_wake");
+}
+
+static void pulse_reader_gpiod_stat_reset(gpiod_io_stat_t *p_stat)
+{
+	enum gpiod_line_value value;
+
+	value = gpiod_line_request_get_value(p_stat->request, p_stat->offset);
+	p_stat->level = value == GPIOD_LINE_VALUE_ACTIVE ? 1 : 0;
+	memset(p_stat->pulse_p, 0, sizeof(p_stat->pulse_p));
+	memset(p_stat->pulse_n, 0, sizeof(p_stat->pulse_n));
+	p_stat->index_p = 0;
+	p_stat->index_n = 0;
+	p_stat->last_edge = 0;
+	p_stat->stopped = true;
+	p_stat->n_samples = 0;
+}
+
+//same as pulse_reader_io_interrupt in module.c, with the event timestamp
+static void pulse_reader_gpiod_edge(gpiod_io_stat_t *p_stat, uint8_t new_level, uint64_t t_current)
+{
+	uint64_t t_width;
+
+	//the kernel may coalesce edges, ignore repeated levels
+	if(p_stat->level == new_level)
+		return;
+	p_stat->level = new_level;
+
+	if(p_stat->stopped || t_current - p_stat->last_edge > MAX_PULSE_WIDTH * NS_PER_MS) {
+		//avoid very long pulse
+		t_width = 0;
+		p_stat->stopped = false;
+	} else {
+		t_width = t_current - p_stat->last_edge;
+	}
+	p_stat->last_edge = t_current;
+
+	if(p_stat->level == 0) {
+		//falling edge, calculate the positive pulse width
+		p_stat->pulse_p[p_stat->index_p] = t_width;
+		p_stat->index_p++;
+		if(p_stat->index_p >= p_stat->filter_win_size)
+			p_stat->index_p = 0;
+		p_stat->n_samples++;
+	} else {
+		//raising edge, calculate the negative pulse width
+		p_stat->pulse_n[p_stat->index_n] = t_width;
+		p_stat->index_n++;
+		if(p_stat->index_n >= p_stat->filter_win_size)
+			p_stat->index_n = 0;
+	}
+}
+
+static void pulse_reader_gpiod_read_events(struct pulse_reader_gpiod_t *p_data, gpiod_io_stat_t *p_stat)
+{
+	int i, n;
+
+	//the request fd is non-blocking only through wait_edge_events, check before read
+	while(gpiod_line_request_wait_edge_events(p_stat->request, 0) > 0) {
+		n = gpiod_line_request_read_edge_events(p_stat->request, p_data->event_buffer, EVENT_BATCH_SIZE);
+		if(n <= 0)
+			break;
+		for(i=0; i<n; i++) {
+			struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(p_data->event_buffer, i);
+
+			pulse_reader_gpiod_edge(p_stat,
+				gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE ? 1 : 0,
+				gpiod_edge_event_get_timestamp_ns(event));
+		}
+		if(n < EVENT_BATCH_SIZE)
+			break;
+	}
+}
+
+static void *pulse_reader_gpiod_thread(void *arg)
+{
+	struct pulse_reader_gpiod_t *p_data = (struct pulse_reader_gpiod_t *)arg;
+	struct pollfd fds[MAX_IO_NUMBER + 1];
+	uint32_t i, n_fds, timeout;
+	uint64_t t_current;
+	char drain[16];
+
+	pthread_mutex_lock(&p_data->lock);
+	while(p_data->running) {
+		fds[0].fd = p_data->wake_pipe[0];
+		fds[0].events = POLLIN;
+		n_fds = 1;
+		for(i=0; i<MAX_IO_NUMBER; i++) {
+			if(!p_data->io_stats[i].used)
+				continue;
+			fds[n_fds].fd = gpiod_line_request_get_fd(p_data->io_stats[i].request);
+			fds[n_fds].events = POLLIN;
+			n_fds++;
+		}
+		timeout = p_data->calculate_period;
+		pthread_mutex_unlock(&p_data->lock);
+
+		if(poll(fds, n_fds, timeout) < 0 && errno != EINTR)
+			perror("pulse_reader_gpiod_thread poll");
+		if(fds[0].revents & POLLIN) {
+			while(read(p_data->wake_pipe[0], drain, sizeof(drain)) > 0)
+				;
+		}
+
+		pthread_mutex_lock(&p_data->lock);
+		//lines may have been removed while polling, so walk the table again
+		for(i=0; i<MAX_IO_NUMBER; i++) {
+			if(p_data->io_stats[i].used)
+				pulse_reader_gpiod_read_events(p_data, &p_data->io_stats[i]);
+		}
+
+		//pulse stopped, same as the timer callback in module.c
+		t_current = pulse_reader_gpiod_now();
+		for(i=0; i<MAX_IO_NUMBER; i++) {
+			gpiod_io_stat_t *p_stat = &p_data->io_stats[i];
+
+			if(p_stat->used && !p_stat->stopped
+				&& t_current - p_stat->last_edge > MAX_PULSE_WIDTH * NS_PER_MS)
+				pulse_reader_gpiod_stat_reset(p_stat);
+		}
+	}
+	pthread_mutex_unlock(&p_data->lock);
+
+	return NULL;
+}
+
+static bool pulse_reader_gpiod_read_attr(const char *dir, const char *name, char *buf, size_t len)
+{
+	char path[512];
+	FILE *fp;
+	bool ok;
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/%s/%s", dir, name);
+	fp = fopen(path, "r");
+	if(!fp)
+		return false;
+	ok = fgets(buf, len, fp) != NULL;
+	fclose(fp);
+	if(ok)
+		buf[strcspn(buf, "\n")] = 0;
+	return ok;
+}
+
+//kernel gpio number of the chip's line 0, so ADD_IO takes the same numbers
+//as the kernel backend (the base is 512 on Pi kernels 6.6 and later)
+static int pulse_reader_gpiod_find_base(struct gpiod_chip *chip, uint32_t *base, uint32_t *num_lines)
+{
+	struct gpiod_chip_info *info;
+	struct dirent *entry;
+	char label[64], buf[64];
+	DIR *dir;
+	int ret = -1;
+
+	info = gpiod_chip_get_info(chip);
+	if(!info)
+		return -1;
+	*num_lines = gpiod_chip_info_get_num_lines(info);
+
+	//legacy sysfs lists every chip with its label and base
+	dir = opendir("/sys/class/gpio");
+	while(dir && (entry = readdir(dir)) != NULL) {
+		if(strncmp(entry->d_name, "gpiochip", 8))
+			continue;
+		if(!pulse_reader_gpiod_read_attr(entry->d_name, "label", label, sizeof(label))
+			|| strcmp(label, gpiod_chip_info_get_label(info)))
+			continue;
+		if(!pulse_reader_gpiod_read_attr(entry->d_name, "ngpio", buf, sizeof(buf))
+			|| (uint32_t)atoi(buf) != *num_lines)
+			continue;
+		if(!pulse_reader_gpiod_read_attr(entry->d_name, "base", buf, sizeof(buf)))
+			continue;
+		*base = atoi(buf);
+		ret = 0;
+		break;
+	}
+	if(dir)
+		closedir(dir);
+	if(ret)
+		fprintf(stderr, "pulse_reader_gpiod_find_base no gpio base for %s in /sys/class/gpio\n",
+			gpiod_chip_info_get_label(info));
+	gpiod_chip_info_free(info);
+	return ret;
+}
+
+struct pulse_reader_gpiod_t *pulse_reader_gpiod_open(const char *chip_path)
+{
+	struct pulse_reader_gpiod_t *p_data;
+
+	p_data = (struct pulse_reader_gpiod_t *)calloc(1, sizeof(struct pulse_reader_gpiod_t));
+	if(!p_data)
+		return NULL;
+
+	p_data->chip = gpiod_chip_open(chip_path);
+	if(!p_data->chip) {
+		perror("pulse_reader_gpiod_open gpiod_chip_open");
+		goto fail_chip;
+	}
+
+	if(pulse_reader_gpiod_find_base(p_data->chip, &p_data->base, &p_data->num_lines)) {
+		errno = ENODEV;
+		goto fail_buffer;
+	}
+
+	p_data->event_buffer = gpiod_edge_event_buffer_new(EVENT_BATCH_SIZE);
+	if(!p_data->event_buffer)
+		goto fail_buffer;
+
+	if(pipe2(p_data->wake_pipe, O_NONBLOCK | O_CLOEXEC))
+		goto fail_pipe;
+
+	pthread_mutex_init(&p_data->lock, NULL);
+	p_data->calculate_period = DEFALT_CALCULATE_PERIOD;
+	p_data->running = true;
+	if(pthread_create(&p_data->thread, NULL, pulse_reader_gpiod_thread, p_data))
+		goto fail_thread;
+
+	return p_data;
+
+fail_thread:
+	pthread_mutex_destroy(&p_data->lock);
+	close(p_data->wake_pipe[0]);
+	close(p_data->wake_pipe[1]);
+fail_pipe:
+	gpiod_edge_event_buffer_free(p_data->event_buffer);
+fail_buffer:
+	gpiod_chip_close(p_data->chip);
+fail_chip:
+	free(p_data);
+	return NULL;
+}
+
+void pulse_reader_gpiod_close(struct pulse_reader_gpiod_t *p_data)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&p_data->lock);
+	p_data->running = false;
+	pthread_mutex_unlock(&p_data->lock);
+	pulse_reader_gpiod_wake(p_data);
+	pthread_join(p_data->thread, NULL);
+
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].used)
+			gpiod_line_request_release(p_data->io_stats[i].request);
+	}
+
+	pthread_mutex_destroy(&p_data->lock);
+	close(p_data->wake_pipe[0]);
+	close(p_data->wake_pipe[1]);
+	gpiod_edge_event_buffer_free(p_data->event_buffer);
+	gpiod_chip_close(p_data->chip);
+	free(p_data);
+}
+
+static struct gpiod_line_request *pulse_reader_gpiod_request_line(struct gpiod_chip *chip, unsigned int offset)
+{
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *line_cfg = NULL;
+	struct gpiod_request_config *req_cfg = NULL;
+	struct gpiod_line_request *request = NULL;
+
+	settings = gpiod_line_settings_new();
+	if(!settings)
+		return NULL;
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+	gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_BOTH);
+	gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+
+	line_cfg = gpiod_line_config_new();
+	if(!line_cfg || gpiod_line_config_add_line_settings(line_cfg, &offset, 1, settings))
+		goto out;
+
+	req_cfg = gpiod_request_config_new();
+	if(!req_cfg)
+		goto out;
+	gpiod_request_config_set_consumer(req_cfg, "pulse_reader");
+	gpiod_request_config_set_event_buffer_size(req_cfg, EVENT_BATCH_SIZE * 4);
+
+	request = gpiod_chip_request_lines(chip, req_cfg, line_cfg);
+
+out:
+	gpiod_request_config_free(req_cfg);
+	gpiod_line_config_free(line_cfg);
+	gpiod_line_settings_free(settings);
+	return request;
+}
+
+int pulse_reader_gpiod_add_io(struct pulse_reader_gpiod_t *p_data, const add_io_t *add_io)
+{
+	struct gpiod_line_request *request;
+	gpiod_io_stat_t *p_stat;
+	uint32_t i, filter_win_size;
+
+	pthread_mutex_lock(&p_data->lock);
+
+	//repeat adding check
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].gpio == add_io->gpio && p_data->io_stats[i].used) {
+			//already added, just reuse
+			pthread_mutex_unlock(&p_data->lock);
+			return 0;
+		}
+	}
+
+	//check available item if IO was not added
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(!(p_data->io_stats[i].used))
+			break;
+	}
+	if(i == MAX_IO_NUMBER) {
+		pthread_mutex_unlock(&p_data->lock);
+		fprintf(stderr, "pulse_reader_gpiod_add_io exceed max io number\n");
+		errno = EFAULT;
+		return -1;
+	}
+	p_stat = &p_data->io_stats[i];
+
+	//same error as the kernel backend for a gpio it can't use
+	if(add_io->gpio < p_data->base || add_io->gpio >= p_data->base + p_data->num_lines) {
+		pthread_mutex_unlock(&p_data->lock);
+		fprintf(stderr, "pulse_reader_gpiod_add_io gpio %u not on this chip\n", add_io->gpio);
+		errno = EFAULT;
+		return -1;
+	}
+
+	request = pulse_reader_gpiod_request_line(p_data->chip, add_io->gpio - p_data->base);
+	if(!request) {
+		pthread_mutex_unlock(&p_data->lock);
+		perror("pulse_reader_gpiod_add_io request line error");
+		return -1;
+	}
+	p_stat->request = request;
+	p_stat->gpio = add_io->gpio;
+	p_stat->offset = add_io->gpio - p_data->base;
+
+	//set filter window size
+	filter_win_size = add_io->filter_win_size;
+	if(filter_win_size > MAX_FILTER_WINDOW_SIZE)
+		filter_win_size = MAX_FILTER_WINDOW_SIZE;
+	if(filter_win_size < MIN_FILTER_WINDOW_SIZE)
+		filter_win_size = MIN_FILTER_WINDOW_SIZE;
+	p_stat->filter_win_size = filter_win_size;
+
+	pulse_reader_gpiod_stat_reset(p_stat);
+	p_stat->used = true;
+
+	pthread_mutex_unlock(&p_data->lock);
+	pulse_reader_gpiod_wake(p_data);
+	return 0;
+}
+
+int pulse_reader_gpiod_remove_io(struct pulse_reader_gpiod_t *p_data, uint32_t gpio)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&p_data->lock);
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].gpio == gpio && p_data->io_stats[i].used) {
+			gpiod_line_request_release(p_data->io_stats[i].request);
+			p_data->io_stats[i].request = NULL;
+			p_data->io_stats[i].used = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&p_data->lock);
+
+	if(i == MAX_IO_NUMBER) {
+		fprintf(stderr, "pulse_reader_gpiod_remove_io io not added %u\n", gpio);
+		errno = EFAULT;
+		return -1;
+	}
+	pulse_reader_gpiod_wake(p_data);
+	return 0;
+}
+
+int pulse_reader_gpiod_set_cal_period(struct pulse_reader_gpiod_t *p_data, uint32_t period)
+{
+	uint32_t i;
+
+	if(period > MAX_CALCULATE_PERIOD)
+		period = MAX_CALCULATE_PERIOD;
+	if(period < MIN_CALCULATE_PERIOD)
+		period = MIN_CALCULATE_PERIOD;
+
+	pthread_mutex_lock(&p_data->lock);
+	p_data->calculate_period = period;
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].used)
+			pulse_reader_gpiod_stat_reset(&p_data->io_stats[i]);
+	}
+	pthread_mutex_unlock(&p_data->lock);
+	pulse_reader_gpiod_wake(p_data);
+	return 0;
+}
+
+static void pulse_reader_gpiod_filter_and_calc(gpiod_io_stat_t *p_stat, uint64_t *duty, uint64_t *cycle)
+{
+	uint64_t pulse_p[MAX_FILTER_WINDOW_SIZE], pulse_n[MAX_FILTER_WINDOW_SIZE];
+	uint32_t mid = p_stat->filter_win_size / 2;
+
+	//work on a copy so the ring buffer order is kept, nth_element gives the
+	//same element as the sorted copy in module.c
+	memcpy(pulse_p, p_stat->pulse_p, p_stat->filter_win_size * sizeof(uint64_t));
+	memcpy(pulse_n, p_stat->pulse_n, p_stat->filter_win_size * sizeof(uint64_t));
+	std::nth_element(pulse_p, pulse_p + mid, pulse_p + p_stat->filter_win_size);
+	std::nth_element(pulse_n, pulse_n + mid, pulse_n + p_stat->filter_win_size);
+
+	*duty = pulse_p[mid];
+	*cycle = pulse_p[mid] + pulse_n[mid];
+}
+
+int pulse_reader_gpiod_get_io_stat(struct pulse_reader_gpiod_t *p_data, get_io_stat_t *get_io_stat)
+{
+	uint32_t i, j;
+	gpiod_io_stat_t *p_stat;
+
+	pthread_mutex_lock(&p_data->lock);
+	for(j=0; j<get_io_stat->n_ios && j<MAX_IO_NUMBER; j++) {
+		for(i=0; i<MAX_IO_NUMBER; i++) {
+			p_stat = &p_data->io_stats[i];
+			if(p_stat->gpio == get_io_stat->io_stat_user[j].gpio && p_stat->used) {
+				//pick up edges queued since the thread last ran
+				pulse_reader_gpiod_read_events(p_data, p_stat);
+				if(!p_stat->stopped) {
+					uint64_t duty, cycle;
+
+					pulse_reader_gpiod_filter_and_calc(p_stat, &duty, &cycle);
+					get_io_stat->io_stat_user[j].duty = (uint32_t)duty;
+					get_io_stat->io_stat_user[j].cycle = (uint32_t)cycle;
+				} else {
+					get_io_stat->io_stat_user[j].duty = 0;
+					get_io_stat->io_stat_user[j].cycle = 0;
+				}
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&p_data->lock);
+
+	return 0;
+}
+
+int pulse_reader_gpiod_get_io_stat_ext(struct pulse_reader_gpiod_t *p_data, io_stat_ext_t *stats, uint32_t n_ios)
+{
+	uint32_t i, j, gpio;
+	uint64_t t_current;
+	gpiod_io_stat_t *p_stat;
+
+	if(n_ios > MAX_IO_NUMBER) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&p_data->lock);
+	t_current = pulse_reader_gpiod_now();
+	for(j=0; j<n_ios; j++) {
+		gpio = stats[j].gpio;
+		memset(&stats[j], 0, sizeof(io_stat_ext_t));
+		stats[j].gpio = gpio;
+		for(i=0; i<MAX_IO_NUMBER; i++) {
+			p_stat = &p_data->io_stats[i];
+			if(p_stat->gpio != gpio || !p_stat->used)
+				continue;
+			pulse_reader_gpiod_read_events(p_data, p_stat);
+			if(p_stat->stopped) {
+				stats[j].flags = IO_STAT_STOPPED;
+			} else {
+				pulse_reader_gpiod_filter_and_calc(p_stat, &stats[j].duty, &stats[j].cycle);
+				if(stats[j].cycle) {
+					stats[j].duty_ratio = stats[j].duty * DUTY_RATIO_SCALE / stats[j].cycle;
+					stats[j].frequency = 1000000000000ULL / stats[j].cycle;
+				}
+				stats[j].n_samples = p_stat->n_samples;
+				stats[j].age = t_current - p_stat->last_edge;
+			}
+			break;
+		}
+		if(i == MAX_IO_NUMBER)
+			stats[j].flags = IO_STAT_NOT_FOUND;
+	}
+	pthread_mutex_unlock(&p_data->lock);
+
+	return 0;
+}
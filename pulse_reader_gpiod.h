@@ -0,0 +1,21 @@
+/*
+	Userspace pulse reader backend on top of libgpiod v2
+ */
+
+#ifndef PULSE_READER_GPIOD_H
+#define PULSE_READER_GPIOD_H
+
+#include "pulse_reader.h"
+
+struct pulse_reader_gpiod_t;
+
+struct pulse_reader_gpiod_t *pulse_reader_gpiod_open(const char *chip_path);
+void pulse_reader_gpiod_close(struct pulse_reader_gpiod_t *p_data);
+
+int pulse_reader_gpiod_add_io(struct pulse_reader_gpiod_t *p_data, const add_io_t *add_io);
+int pulse_reader_gpiod_remove_io(struct pulse_reader_gpiod_t *p_data, uint32_t gpio);
+int pulse_reader_gpiod_set_cal_period(struct pulse_reader_gpiod_t *p_data, uint32_t period);
+int pulse_reader_gpiod_get_io_stat(struct pulse_reader_gpiod_t *p_data, get_io_stat_t *get_io_stat);
+int pulse_reader_gpiod_get_io_stat_ext(struct pulse_reader_gpiod_t *p_data, io_stat_ext_t *stats, uint32_t n_ios);
+
+#endif
@@ -14,6 +14,13 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/moduleparam.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/math64.h>
+#include <linux/cache.h>
 
 // #define PULSE_READER_DEBUG
 
@@ -34,10 +41,23 @@
 #define	MIN_CALCULATE_PERIOD		10
 #define	DEFALT_CALCULATE_PERIOD		10
 
+//timestamp clocks, see ts_clock
+#define	TS_CLOCK_MONOTONIC			0
+#define	TS_CLOCK_MONOTONIC_RAW		1//not slewed by NTP
+#define	TS_CLOCK_MONOTONIC_FAST		2//lockless, cheapest read
+
+//weight of the new sample in latency and jitter averages is 1/2^shift
+#define	AVG_SHIFT					4
+
 #define	ADD_IO						0x7B01
 #define	REMOVE_IO					0x7B02
 #define	SET_CAL_PERIOD				0x7B03//set calculate_period in ms
 #define	GET_IO_STAT					0x7B04
+#define	GET_IO_STAT_EXT				0x7B05
+
+#define	DUTY_RATIO_SCALE			1000000//duty_ratio in ppm
+#define	IO_STAT_STOPPED				0x1//io_stat_ext_t flags
+#define	IO_STAT_NOT_FOUND			0x2//gpio was not added
 
 typedef struct
 {
@@ -58,12 +78,38 @@ typedef struct
 	uint32_t n_ios;
 } get_io_stat_t;
 
+//extended stat record, fields are only ever appended
+//callers pass the record size they were built with, the driver fills the
+//part both sides know and zeroes the rest
+typedef struct
+{
+	uint32_t gpio;
+	uint32_t flags;
+	uint64_t duty;//in nanosecond
+	uint64_t cycle;//in nanosecond
+	uint32_t duty_ratio;//duty/cycle in ppm
+	uint32_t frequency;//in mHz
+	uint64_t n_samples;//positive pulses since the channel was reset
+	uint64_t age;//nanoseconds since the last edge
+} io_stat_ext_t;
+
+typedef struct
+{
+	uint32_t size;//sizeof(get_io_stat_ext_t)
+	uint32_t stat_size;//sizeof(io_stat_ext_t)
+	uint32_t n_ios;
+	uint32_t reserved;
+	uint64_t stats;//user pointer to n_ios records with gpio filled in
+} get_io_stat_ext_t;
+
+//per edge state, written by the gpio interrupt under its own lock
+//each channel starts on its own cacheline so edges handled on different
+//cpus don't bounce each other's lines or the config below
 typedef struct
 {
+	spinlock_t lock;
 	uint32_t gpio;
 	uint32_t filter_win_size;
-	uint32_t irq;
-	bool used;
 
 	//runtime stats
 	uint8_t level;
@@ -72,17 +118,43 @@ typedef struct
 	uint32_t index_p;
 	uint32_t index_n;
 	ktime_t last_edge;//time since last edge
-	ktime_t last_cycle;//pulse width in last timer cycle
 	bool stopped;
-} io_stat_t;
+
+	//jitter of positive pulse width between consecutive pulses
+	ktime_t last_width_p;
+	s64 jitter_avg;//in ns
+	s64 jitter_max;
+
+	//filter output, only recalculated after new edges
+	bool calc_dirty;
+	u64 duty;//in ns
+	u64 cycle;
+	u32 duty_ratio;
+	u32 frequency;
+	u64 n_samples;
+	ktime_t edge_time;//time of last edge, compensated with ts_compensate
+} ____cacheline_aligned_in_smp io_stat_t;
+
+//channel config, only changed by ioctl/sysfs under rlock
+typedef struct
+{
+	uint32_t irq;
+	bool used;
+	bool pending;//reserved by add_io/remove_io while they sleep outside rlock
+	struct kobject *kobj;//sysfs gpioN directory
+} io_cfg_t;
 
 struct pulse_reader_data_t {
+	io_stat_t io_stats[MAX_IO_NUMBER];
+
 	struct cdev cdev;
 
+	//protects io_cfgs and calculate_period, taken before any channel lock
 	spinlock_t rlock;
 
-	io_stat_t io_stats[MAX_IO_NUMBER];
+	io_cfg_t io_cfgs[MAX_IO_NUMBER];
 	uint32_t calculate_period;//in ms
+	uint32_t entry_latency;//estimated irq entry latency in ns, 32 bit so the lockless reads can't tear
 
 	struct hrtimer pulse_timer;
 };
@@ -90,9 +162,42 @@ struct pulse_reader_data_t {
 static struct class *pulse_reader_class;
 static struct pulse_reader_data_t *pulse_reader_data;
 
+static struct device *pulse_reader_device;
+
 static int pulse_reader_major;
 static int pulse_reader_minor;
 
+//boot time channels, "gpio[:filter_win_size]", e.g. channels=25:5,26:3
+static char *channels[MAX_IO_NUMBER];
+static int n_channels;
+module_param_array(channels, charp, &n_channels, 0444);
+MODULE_PARM_DESC(channels, "I/Os captured from module load, gpio[:filter_win_size]");
+
+static uint calculate_period = DEFALT_CALCULATE_PERIOD;
+module_param(calculate_period, uint, 0444);
+MODULE_PARM_DESC(calculate_period, "Timer period in ms");
+
+static uint ts_clock = TS_CLOCK_MONOTONIC;
+module_param(ts_clock, uint, 0444);
+MODULE_PARM_DESC(ts_clock, "Edge timestamp clock, 0 monotonic, 1 monotonic raw, 2 monotonic fast");
+
+static bool ts_compensate;
+module_param(ts_compensate, bool, 0444);
+MODULE_PARM_DESC(ts_compensate, "Subtract the estimated irq entry latency from the last edge time (age)");
+
+//timer callback and edge interrupt must use the same clock
+static inline ktime_t pulse_reader_get_time(void)
+{
+	switch(ts_clock) {
+	case TS_CLOCK_MONOTONIC_RAW:
+		return ktime_get_raw();
+	case TS_CLOCK_MONOTONIC_FAST:
+		return ns_to_ktime(ktime_get_mono_fast_ns());
+	default:
+		return ktime_get();
+	}
+}
+
 int pulse_reader_open(struct inode *inode, struct file *filp)
 {
 	struct pulse_reader_data_t *p_data;
@@ -129,8 +234,17 @@ static void pulse_reader_stat_reset(io_stat_t *p_stat)
 	p_stat->index_p = 0;
 	p_stat->index_n = 0;
 	p_stat->last_edge = ktime_set(0, 0);
-	p_stat->last_cycle = ktime_set(0, 0);
 	p_stat->stopped = true;
+	p_stat->last_width_p = ktime_set(0, 0);
+	p_stat->jitter_avg = 0;
+	p_stat->jitter_max = 0;
+	p_stat->calc_dirty = false;
+	p_stat->duty = 0;
+	p_stat->cycle = 0;
+	p_stat->duty_ratio = 0;
+	p_stat->frequency = 0;
+	p_stat->n_samples = 0;
+	p_stat->edge_time = ktime_set(0, 0);
 }
 
 static int pulse_reader_sort_cmp_func(const void *opp1, const void *opp2)
@@ -139,10 +253,23 @@ static int pulse_reader_sort_cmp_func(const void *opp1, const void *opp2)
 	return ktime_compare(*t1, *t2);
 }
 
-static void pulse_reader_filter_and_calc(io_stat_t *p_stat, uint32_t *duty, uint32_t *cycle)
+//median of the ring, sorted in a copy so the ring keeps its order and the
+//next edge overwrites the oldest width, same as the gpiod backend
+static ktime_t pulse_reader_median(const ktime_t *ring, uint32_t size)
+{
+	ktime_t buf[MAX_FILTER_WINDOW_SIZE];
+
+	memcpy(buf, ring, size * sizeof(ktime_t));
+	sort((void*)buf, size, sizeof(ktime_t), pulse_reader_sort_cmp_func, NULL);
+	return buf[size/2];
+}
+
+static void pulse_reader_filter_and_calc(io_stat_t *p_stat, u64 *duty, u64 *cycle)
 {
+	ktime_t median_p, median_n;
+
 #ifdef PULSE_READER_DEBUG
-	printk(KERN_DEBUG  "pulse_reader_filter_and_calc before p-n=%u-%u %u-%u %u-%u %u-%u %u-%u\n",
+	printk(KERN_DEBUG  "pulse_reader_filter_and_calc p-n=%u-%u %u-%u %u-%u %u-%u %u-%u\n",
 		(uint32_t)ktime_to_us(p_stat->pulse_p[0]),
 		(uint32_t)ktime_to_us(p_stat->pulse_n[0]),
 		(uint32_t)ktime_to_us(p_stat->pulse_p[1]),
@@ -156,32 +283,35 @@ static void pulse_reader_filter_and_calc(io_stat_t *p_stat, uint32_t *duty, uint
 #endif
 
 	if(p_stat->filter_win_size > 1) {
-		//run median filter
-		sort((void*)p_stat->pulse_p, p_stat->filter_win_size, sizeof(ktime_t), pulse_reader_sort_cmp_func, NULL);
-		sort((void*)p_stat->pulse_n, p_stat->filter_win_size, sizeof(ktime_t), pulse_reader_sort_cmp_func, NULL);
-
-		//get the median value and calculate cycle
-		*duty = ktime_to_ns(p_stat->pulse_p[p_stat->filter_win_size/2]);
-		*cycle = ktime_to_ns(ktime_add(p_stat->pulse_p[p_stat->filter_win_size/2],
-			p_stat->pulse_n[p_stat->filter_win_size/2]));
+		//run median filter, one array at a time to keep the stack small
+		median_p = pulse_reader_median(p_stat->pulse_p, p_stat->filter_win_size);
+		median_n = pulse_reader_median(p_stat->pulse_n, p_stat->filter_win_size);
 	} else {
-		*duty = ktime_to_ns(p_stat->pulse_p[0]);
-		*cycle = ktime_to_ns(ktime_add(p_stat->pulse_p[0], p_stat->pulse_n[0]));
+		median_p = p_stat->pulse_p[0];
+		median_n = p_stat->pulse_n[0];
 	}
 
-#ifdef PULSE_READER_DEBUG
-	printk(KERN_DEBUG  "pulse_reader_filter_and_calc after p-n=%u-%u %u-%u %u-%u %u-%u %u-%u\n",
-		(uint32_t)ktime_to_us(p_stat->pulse_p[0]),
-		(uint32_t)ktime_to_us(p_stat->pulse_n[0]),
-		(uint32_t)ktime_to_us(p_stat->pulse_p[1]),
-		(uint32_t)ktime_to_us(p_stat->pulse_n[1]),
-		(uint32_t)ktime_to_us(p_stat->pulse_p[2]),
-		(uint32_t)ktime_to_us(p_stat->pulse_n[2]),
-		(uint32_t)ktime_to_us(p_stat->pulse_p[3]),
-		(uint32_t)ktime_to_us(p_stat->pulse_n[3]),
-		(uint32_t)ktime_to_us(p_stat->pulse_p[4]),
-		(uint32_t)ktime_to_us(p_stat->pulse_n[4]));
-#endif
+	//get the median value and calculate cycle
+	*duty = ktime_to_ns(median_p);
+	*cycle = ktime_to_ns(ktime_add(median_p, median_n));
+}
+
+//run the filter and derived values once per batch of new widths, so
+//readers polling faster than the signal don't repeat the work
+static void pulse_reader_update_calc(io_stat_t *p_stat)
+{
+	if(!p_stat->calc_dirty)
+		return;
+
+	pulse_reader_filter_and_calc(p_stat, &p_stat->duty, &p_stat->cycle);
+	if(p_stat->cycle) {
+		p_stat->duty_ratio = div64_u64(p_stat->duty * DUTY_RATIO_SCALE, p_stat->cycle);
+		p_stat->frequency = div64_u64(NSEC_PER_SEC * 1000ULL, p_stat->cycle);
+	} else {
+		p_stat->duty_ratio = 0;
+		p_stat->frequency = 0;
+	}
+	p_stat->calc_dirty = false;
 }
 
 static enum hrtimer_restart pulse_reader_timer_cb(struct hrtimer *timer)
@@ -191,49 +321,55 @@ static enum hrtimer_restart pulse_reader_timer_cb(struct hrtimer *timer)
 	struct pulse_reader_data_t *p_data =
 		container_of(timer, struct pulse_reader_data_t, pulse_timer);
 	ktime_t t_current;
+	s64 t_late;
 
 	//get current time
-	t_current = hrtimer_cb_get_time(&p_data->pulse_timer);
+	t_current = pulse_reader_get_time();
+
+	//how late the timer interrupt ran, its floor is taken as the systematic
+	//irq entry latency, drops follow at once and rises slowly
+	t_late = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer), hrtimer_get_expires(timer)));
 
 	spin_lock_irqsave(&p_data->rlock, irq_flags);
+	if(t_late >= 0 && t_late < NSEC_PER_MSEC) {
+		uint32_t latency = p_data->entry_latency;
+
+		if(latency == 0 || t_late < latency)
+			latency = t_late;
+		else
+			latency += (uint32_t)(t_late - latency) >> AVG_SHIFT;
+		WRITE_ONCE(p_data->entry_latency, latency);
+	}
 	for(i=0; i<MAX_IO_NUMBER; i++) {
 		io_stat_t *p_stat;
 
 		p_stat = &(p_data->io_stats[i]);
 
-		if(!(p_stat->used) || p_stat->stopped)
+		if(!(p_data->io_cfgs[i].used))
 			continue;
 
+		spin_lock(&p_stat->lock);
+		if(p_stat->stopped) {
+			spin_unlock(&p_stat->lock);
+			continue;
+		}
+
 #ifdef PULSE_READER_DEBUG
-		printk(KERN_DEBUG  "pulse_reader_timer_cb lastc=%u, laste=%u\n",
-			(uint32_t)ktime_to_us(p_stat->last_cycle),
+		printk(KERN_DEBUG  "pulse_reader_timer_cb cur=%u, laste=%u\n",
+			(uint32_t)ktime_to_us(t_current),
 			(uint32_t)ktime_to_us(p_stat->last_edge));
 #endif
 
-		if(ktime_to_ns(p_stat->last_cycle) != 0) {
-			//none zero means there's no edge in last period
-			p_stat->last_cycle = ktime_add(ms_to_ktime(p_data->calculate_period), p_stat->last_cycle);
-			if(ktime_compare(p_stat->last_cycle, ms_to_ktime(MAX_PULSE_WIDTH)) > 0) {
-				//pulse stopped, reset data and set stop flag
-				pulse_reader_stat_reset(p_stat);
+		//the timer only detects stopped pulses, widths are measured edge
+		//to edge in the interrupt like in the gpiod backend
+		if(ktime_compare(ktime_sub(t_current, p_stat->last_edge), ms_to_ktime(MAX_PULSE_WIDTH)) > 0) {
+			//pulse stopped, reset data and set stop flag
+			pulse_reader_stat_reset(p_stat);
 #ifdef PULSE_READER_DEBUG
-				printk(KERN_DEBUG  "pulse_reader_timer_cb pulse on gpio %d stopped\n", p_stat->gpio);
+			printk(KERN_DEBUG  "pulse_reader_timer_cb pulse on gpio %d stopped\n", p_stat->gpio);
 #endif
-				continue;
-			}
-		} else {
-			//record the part of time in last period
-			p_stat->last_cycle = ktime_sub(t_current, p_stat->last_edge);
 		}
-		//set the last edge position to current
-		p_stat->last_edge = t_current;
-
-#ifdef PULSE_READER_DEBUG
-		printk(KERN_DEBUG  "pulse_reader_timer_cb cur=%u, lastc=%u, laste=%u\n",
-			(uint32_t)ktime_to_us(t_current),
-			(uint32_t)ktime_to_us(p_stat->last_cycle),
-			(uint32_t)ktime_to_us(p_stat->last_edge));
-#endif
+		spin_unlock(&p_stat->lock);
 	}
 	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
 
@@ -242,43 +378,32 @@ static enum hrtimer_restart pulse_reader_timer_cb(struct hrtimer *timer)
 	return HRTIMER_RESTART;
 }
 
+//dev_id is the channel, only its own lock is taken so channels on
+//different cpus don't serialize on rlock
 static irqreturn_t pulse_reader_io_interrupt(int irq, void *dev_id)
 {
-	uint32_t i;
-	io_stat_t *p_stat;
+	io_stat_t *p_stat = (io_stat_t *) dev_id;
 	unsigned long irq_flags;
 	ktime_t t_current, t_width;
-	struct pulse_reader_data_t *p_data = (struct pulse_reader_data_t *) dev_id;
 	uint8_t new_level;
 
-	//get current timestamp
-	t_current = hrtimer_cb_get_time(&p_data->pulse_timer);
+	//get current timestamp first, before any lock or register access
+	t_current = pulse_reader_get_time();
 
-	spin_lock_irqsave(&p_data->rlock, irq_flags);
-
-	for(i=0; i<MAX_IO_NUMBER; i++) {
-		if(p_data->io_stats[i].irq == irq
-			&& p_data->io_stats[i].used)
-			break;
-	}
-	if(i == MAX_IO_NUMBER) {
-		spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-		printk(KERN_ERR "pulse_reader_io_interrupt unknown irq %d\n", irq);
-		return IRQ_NONE;
-	}
-	p_stat = &(p_data->io_stats[i]);
+	spin_lock_irqsave(&p_stat->lock, irq_flags);
 
 	//check and ignore the interrupt
 	//in case it generates fake ones while there's no actual edge
 	new_level = gpio_get_value(p_stat->gpio);
 	if(p_stat->level == new_level) {
-		spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+		spin_unlock_irqrestore(&p_stat->lock, irq_flags);
 		return IRQ_HANDLED;
 	}
 	p_stat->level = new_level;
 
 	//calculate width and update stop flag
-	if(p_stat->stopped) {
+	if(p_stat->stopped
+		|| ktime_compare(ktime_sub(t_current, p_stat->last_edge), ms_to_ktime(MAX_PULSE_WIDTH)) > 0) {
 		//avoid very long pulse
 		t_width = ktime_set(0, 0);
 		p_stat->stopped = false;
@@ -287,48 +412,445 @@ static irqreturn_t pulse_reader_io_interrupt(int irq, void *dev_id)
 	}
 
 #ifdef PULSE_READER_DEBUG
-	printk(KERN_DEBUG "pulse_reader_io_interrupt gpio=%u, tcur=%u, width=%u, laste=%u, lastc=%u, pi-ni=%u-%u, pol=%c\n",
+	printk(KERN_DEBUG "pulse_reader_io_interrupt gpio=%u, tcur=%u, width=%u, laste=%u, pi-ni=%u-%u, pol=%c\n",
 		p_stat->gpio,
 		(uint32_t)ktime_to_us(t_current),
 		(uint32_t)ktime_to_us(t_width),
 		(uint32_t)ktime_to_us(p_stat->last_edge),
-		(uint32_t)ktime_to_us(p_stat->last_cycle),
 		p_stat->index_p, p_stat->index_n,
 		p_stat->level ? 'N' : 'P');
 #endif
 
 	p_stat->last_edge = t_current;
-
-	//if there's part of the pulse in last timer cycle, add it
-	if(ktime_to_ns(p_stat->last_cycle) != 0) {
-		t_width = ktime_add(t_width, p_stat->last_cycle);
-		p_stat->last_cycle = ktime_set(0, 0);
-	}
+	//only the absolute edge time is compensated, the estimate moves between
+	//edges and would add its own jitter to the widths
+	p_stat->edge_time = t_current;
+	if(ts_compensate)
+		p_stat->edge_time = ktime_sub_ns(t_current, READ_ONCE(pulse_reader_data->entry_latency));
 
 	//store width in either positive pulse array or negative array
 	//jump to next once both items have value
 	if(p_stat->level == 0) {
 		//falling edge, calculate the positive pulse width
+		if(ktime_to_ns(t_width) != 0 && ktime_to_ns(p_stat->last_width_p) != 0) {
+			s64 t_jitter = abs(ktime_to_ns(ktime_sub(t_width, p_stat->last_width_p)));
+
+			p_stat->jitter_avg += (t_jitter - p_stat->jitter_avg) >> AVG_SHIFT;
+			if(t_jitter > p_stat->jitter_max)
+				p_stat->jitter_max = t_jitter;
+		}
+		p_stat->last_width_p = t_width;
 		p_stat->pulse_p[p_stat->index_p] = t_width;
 		p_stat->index_p++;
 		if(p_stat->index_p >= p_stat->filter_win_size)
 			p_stat->index_p = 0;
+		p_stat->n_samples++;
+		p_stat->calc_dirty = true;
 	} else if(p_stat->level == 1) {
 		//raising edge, calculate the negative pulse width
 		p_stat->pulse_n[p_stat->index_n] = t_width;
 		p_stat->index_n++;
 		if(p_stat->index_n >= p_stat->filter_win_size)
 			p_stat->index_n = 0;
+		p_stat->calc_dirty = true;
 	} else {
 		pulse_reader_stat_reset(p_stat);
 		printk(KERN_ERR "pulse_reader_io_interrupt gpio_get_value returns %d!\n", p_stat->level);
 	}
 
-	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+	spin_unlock_irqrestore(&p_stat->lock, irq_flags);
 
 	return IRQ_HANDLED;
 }
 
+static int pulse_reader_add_io(struct pulse_reader_data_t *p_data, uint32_t gpio, uint32_t filter_win_size);
+static int pulse_reader_remove_io(struct pulse_reader_data_t *p_data, uint32_t gpio);
+static void pulse_reader_set_cal_period(struct pulse_reader_data_t *p_data, uint32_t period);
+
+static io_stat_t *pulse_reader_find_kobj(struct kobject *kobj)
+{
+	int i;
+
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(pulse_reader_data->io_cfgs[i].used
+			&& pulse_reader_data->io_cfgs[i].kobj == kobj)
+			return &(pulse_reader_data->io_stats[i]);
+	}
+	return NULL;
+}
+
+static ssize_t filter_win_size_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	unsigned long irq_flags;
+	io_stat_t *p_stat;
+	uint32_t filter_win_size = 0;
+
+	spin_lock_irqsave(&pulse_reader_data->rlock, irq_flags);
+	p_stat = pulse_reader_find_kobj(kobj);
+	if(p_stat)
+		filter_win_size = p_stat->filter_win_size;
+	spin_unlock_irqrestore(&pulse_reader_data->rlock, irq_flags);
+
+	return p_stat ? sysfs_emit(buf, "%u\n", filter_win_size) : -ENODEV;
+}
+
+static ssize_t filter_win_size_store(struct kobject *kobj, struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+	unsigned long irq_flags;
+	io_stat_t *p_stat;
+	uint32_t filter_win_size;
+
+	if(kstrtou32(buf, 0, &filter_win_size))
+		return -EINVAL;
+	if(filter_win_size > MAX_FILTER_WINDOW_SIZE)
+		filter_win_size = MAX_FILTER_WINDOW_SIZE;
+	if(filter_win_size < MIN_FILTER_WINDOW_SIZE)
+		filter_win_size = MIN_FILTER_WINDOW_SIZE;
+
+	spin_lock_irqsave(&pulse_reader_data->rlock, irq_flags);
+	p_stat = pulse_reader_find_kobj(kobj);
+	if(p_stat) {
+		spin_lock(&p_stat->lock);
+		p_stat->filter_win_size = filter_win_size;
+		pulse_reader_stat_reset(p_stat);
+		spin_unlock(&p_stat->lock);
+	}
+	spin_unlock_irqrestore(&pulse_reader_data->rlock, irq_flags);
+
+	return p_stat ? count : -ENODEV;
+}
+
+static ssize_t pulse_reader_stat_show(struct kobject *kobj, char *buf, bool show_duty)
+{
+	unsigned long irq_flags;
+	io_stat_t *p_stat;
+	u64 duty = 0, cycle = 0;
+
+	spin_lock_irqsave(&pulse_reader_data->rlock, irq_flags);
+	p_stat = pulse_reader_find_kobj(kobj);
+	if(p_stat) {
+		spin_lock(&p_stat->lock);
+		if(!p_stat->stopped) {
+			pulse_reader_update_calc(p_stat);
+			duty = p_stat->duty;
+			cycle = p_stat->cycle;
+		}
+		spin_unlock(&p_stat->lock);
+	}
+	spin_unlock_irqrestore(&pulse_reader_data->rlock, irq_flags);
+
+	if(!p_stat)
+		return -ENODEV;
+	return sysfs_emit(buf, "%llu\n", show_duty ? duty : cycle);
+}
+
+static ssize_t duty_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return pulse_reader_stat_show(kobj, buf, true);
+}
+
+static ssize_t cycle_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return pulse_reader_stat_show(kobj, buf, false);
+}
+
+//average and max change of positive pulse width between pulses, in ns
+static ssize_t jitter_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	unsigned long irq_flags;
+	io_stat_t *p_stat;
+	s64 jitter_avg = 0, jitter_max = 0;
+
+	spin_lock_irqsave(&pulse_reader_data->rlock, irq_flags);
+	p_stat = pulse_reader_find_kobj(kobj);
+	if(p_stat) {
+		spin_lock(&p_stat->lock);
+		jitter_avg = p_stat->jitter_avg;
+		jitter_max = p_stat->jitter_max;
+		spin_unlock(&p_stat->lock);
+	}
+	spin_unlock_irqrestore(&pulse_reader_data->rlock, irq_flags);
+
+	if(!p_stat)
+		return -ENODEV;
+	return sysfs_emit(buf, "%lld %lld\n", jitter_avg, jitter_max);
+}
+
+static struct kobj_attribute filter_win_size_attr = __ATTR_RW(filter_win_size);
+static struct kobj_attribute duty_attr = __ATTR_RO(duty);
+static struct kobj_attribute cycle_attr = __ATTR_RO(cycle);
+static struct kobj_attribute jitter_attr = __ATTR_RO(jitter);
+
+static struct attribute *pulse_reader_channel_attrs[] = {
+	&filter_win_size_attr.attr,
+	&duty_attr.attr,
+	&cycle_attr.attr,
+	&jitter_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group pulse_reader_channel_group = {
+	.attrs = pulse_reader_channel_attrs,
+};
+
+//writing "gpio [filter_win_size]" works like ADD_IO and creates a gpioN directory
+static ssize_t add_io_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	uint32_t gpio, filter_win_size = DEFALT_FILTER_WINDOW_SIZE;
+	int ret;
+
+	if(!pulse_reader_data)
+		return -ENODEV;
+	if(sscanf(buf, "%u %u", &gpio, &filter_win_size) < 1)
+		return -EINVAL;
+
+	ret = pulse_reader_add_io(pulse_reader_data, gpio, filter_win_size);
+	return ret ? ret : count;
+}
+
+static ssize_t remove_io_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	uint32_t gpio;
+	int ret;
+
+	if(!pulse_reader_data)
+		return -ENODEV;
+	if(kstrtou32(buf, 0, &gpio))
+		return -EINVAL;
+
+	ret = pulse_reader_remove_io(pulse_reader_data, gpio);
+	return ret ? ret : count;
+}
+
+static ssize_t calculate_period_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	if(!pulse_reader_data)
+		return -ENODEV;
+	return sysfs_emit(buf, "%u\n", pulse_reader_data->calculate_period);
+}
+
+static ssize_t calculate_period_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	uint32_t period;
+
+	if(!pulse_reader_data)
+		return -ENODEV;
+	if(kstrtou32(buf, 0, &period))
+		return -EINVAL;
+
+	pulse_reader_set_cal_period(pulse_reader_data, period);
+	return count;
+}
+
+static ssize_t entry_latency_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	if(!pulse_reader_data)
+		return -ENODEV;
+	return sysfs_emit(buf, "%u\n", READ_ONCE(pulse_reader_data->entry_latency));
+}
+
+static DEVICE_ATTR_WO(add_io);
+static DEVICE_ATTR_WO(remove_io);
+static DEVICE_ATTR_RW(calculate_period);
+static DEVICE_ATTR_RO(entry_latency);
+
+static struct attribute *pulse_reader_attrs[] = {
+	&dev_attr_add_io.attr,
+	&dev_attr_remove_io.attr,
+	&dev_attr_calculate_period.attr,
+	&dev_attr_entry_latency.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(pulse_reader);
+
+static int pulse_reader_add_io(struct pulse_reader_data_t *p_data, uint32_t gpio, uint32_t filter_win_size)
+{
+	unsigned long irq_flags;
+	int io_irq, ret, i;
+	io_stat_t *p_stat;
+	struct kobject *kobj = NULL;
+
+	if(!gpio_is_valid(gpio))
+		return -EFAULT;
+
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+
+	//repeat adding check
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].gpio != gpio)
+			continue;
+		if(p_data->io_cfgs[i].pending) {
+			//being added or removed by someone else
+			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+			return -EBUSY;
+		}
+		if(p_data->io_cfgs[i].used) {
+			//already added, just reuse
+			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+			printk(KERN_INFO "pulse_reader_add_io io already added\n");
+			return 0;
+		}
+	}
+
+	//check available item if IO was not added
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(!p_data->io_cfgs[i].used && !p_data->io_cfgs[i].pending)
+			break;
+	}
+	if(i == MAX_IO_NUMBER) {
+		spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+		printk(KERN_ERR "pulse_reader_add_io exceed max io number\n");
+		return -EFAULT;
+	}
+
+	//reserve the slot, gpio_request, request_irq and sysfs may sleep so they
+	//run outside the lock and the slot is only published once all succeeded
+	p_stat = &(p_data->io_stats[i]);
+	p_data->io_cfgs[i].pending = true;
+	spin_lock(&p_stat->lock);
+	p_stat->gpio = gpio;
+	spin_unlock(&p_stat->lock);
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+	//request gpio
+	ret = gpio_request(gpio, "pulse_reader");
+	if(ret) {
+		printk(KERN_ERR "pulse_reader_add_io request io error\n");
+		goto fail_slot;
+	}
+	gpio_direction_input(gpio);
+
+	//set filter window size
+	if(filter_win_size > MAX_FILTER_WINDOW_SIZE)
+		filter_win_size = MAX_FILTER_WINDOW_SIZE;
+	if(filter_win_size < MIN_FILTER_WINDOW_SIZE)
+		filter_win_size = MIN_FILTER_WINDOW_SIZE;
+
+	//reset data before the irq can fire, this must be called post to gpio_request
+	spin_lock_irqsave(&p_stat->lock, irq_flags);
+	p_stat->filter_win_size = filter_win_size;
+	pulse_reader_stat_reset(p_stat);
+	spin_unlock_irqrestore(&p_stat->lock, irq_flags);
+
+	//request irq
+	io_irq = gpio_to_irq(gpio);
+	if(io_irq < 0) {
+		ret = io_irq;
+		printk(KERN_ERR "pulse_reader_add_io no irq for gpio %u\n", gpio);
+		goto fail_gpio;
+	}
+	ret = request_irq(io_irq, pulse_reader_io_interrupt,
+		IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING, "pulse_reader_io_interrupt", p_stat);
+	if(ret) {
+		printk(KERN_ERR "pulse_reader_add_io can not get irq\n");
+		goto fail_gpio;
+	}
+
+	//sysfs directory, its attributes find the channel through kobj so they
+	//return -ENODEV until the slot is published below
+	if(pulse_reader_device) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "gpio%u", gpio);
+		kobj = kobject_create_and_add(name, &pulse_reader_device->kobj);
+		if(kobj && sysfs_create_group(kobj, &pulse_reader_channel_group)) {
+			kobject_put(kobj);
+			kobj = NULL;
+		}
+		if(!kobj)
+			printk(KERN_ERR "pulse_reader_add_io can not create sysfs for gpio %u\n", gpio);
+	}
+
+	//publish, the slot was pending so nobody else touched it meanwhile
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+	p_data->io_cfgs[i].irq = io_irq;
+	p_data->io_cfgs[i].kobj = kobj;
+	p_data->io_cfgs[i].used = true;
+	p_data->io_cfgs[i].pending = false;
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+	return 0;
+
+fail_gpio:
+	gpio_free(gpio);
+fail_slot:
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+	p_data->io_cfgs[i].pending = false;
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+	return ret;
+}
+
+static int pulse_reader_remove_io(struct pulse_reader_data_t *p_data, uint32_t gpio)
+{
+	unsigned long irq_flags;
+	io_cfg_t cfg = { 0 };
+	uint32_t i;
+
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(p_data->io_stats[i].gpio == gpio
+			&& p_data->io_cfgs[i].used) {
+			//unpublish but keep the slot reserved until the irq and
+			//gpio are released, add_io can't reuse it before that
+			cfg = p_data->io_cfgs[i];
+			p_data->io_cfgs[i].used = false;
+			p_data->io_cfgs[i].pending = true;
+			p_data->io_cfgs[i].kobj = NULL;
+			break;
+		}
+	}
+	if(i == MAX_IO_NUMBER) {
+		spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+		printk(KERN_ERR "pulse_reader_remove_io io not added %d\n", gpio);
+		return -EFAULT;
+	}
+
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+	//free_irq waits for a running handler, so it is called outside the lock
+	free_irq(cfg.irq, &(p_data->io_stats[i]));
+	gpio_free(gpio);
+	if(cfg.kobj)
+		kobject_put(cfg.kobj);
+
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+	p_data->io_cfgs[i].pending = false;
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+	return 0;
+}
+
+static void pulse_reader_set_cal_period(struct pulse_reader_data_t *p_data, uint32_t period)
+{
+	unsigned long irq_flags;
+	uint32_t i;
+
+	if(period > MAX_CALCULATE_PERIOD)
+		period = MAX_CALCULATE_PERIOD;
+	if(period < MIN_CALCULATE_PERIOD)
+		period = MIN_CALCULATE_PERIOD;
+
+	spin_lock_irqsave(&p_data->rlock, irq_flags);
+	p_data->calculate_period = period;
+	for(i=0; i<MAX_IO_NUMBER; i++) {
+		if(!p_data->io_cfgs[i].used)
+			continue;
+		spin_lock(&p_data->io_stats[i].lock);
+		pulse_reader_stat_reset(&p_data->io_stats[i]);
+		spin_unlock(&p_data->io_stats[i].lock);
+	}
+	spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+	//hrtimer_cancel waits for a running callback, which takes rlock
+	hrtimer_cancel(&p_data->pulse_timer);
+	hrtimer_start(&p_data->pulse_timer, ms_to_ktime(period), HRTIMER_MODE_REL);
+}
+
 //static int pulse_reader_ioctl(struct inode * inode,struct file* filp, unsigned int cmd, unsigned long arg)
 static long pulse_reader_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
@@ -339,122 +861,32 @@ static long pulse_reader_ioctl(struct file *file, unsigned int cmd, unsigned lon
 	{
 	case ADD_IO:
 		{
-			int io_irq, ret, i;
 			add_io_t add_io;
 
 			if(copy_from_user(&add_io, (void *)arg, sizeof(add_io_t)))
 				return -EFAULT;
 
-			if(!gpio_is_valid(add_io.gpio))
-				return -EFAULT;
-
-			spin_lock_irqsave(&p_data->rlock, irq_flags);
-
-			//repeat adding check
-			for(i=0; i<MAX_IO_NUMBER; i++) {
-				if(p_data->io_stats[i].gpio == add_io.gpio
-					&& p_data->io_stats[i].used) {
-					//already added, just reuse
-					spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-					printk(KERN_INFO "pulse_reader_ioctl request ADD_IO io already added\n");
-					return 0;
-				}
-			}
-
-			//check available item if IO was not added
-			for(i=0; i<MAX_IO_NUMBER; i++) {
-				if(!(p_data->io_stats[i].used))
-					break;
-			}
-			if(i == MAX_IO_NUMBER) {
-				spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-				printk(KERN_ERR "pulse_reader_ioctl ADD_IO exceed max io number\n");
-				return -EFAULT;
-			}
-
-			//request gpio
-			ret = gpio_request(add_io.gpio, "pulse_reader");
-			if(ret) {
-				spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-				printk(KERN_ERR "pulse_reader_ioctl ADD_IO request io error\n");
-				return ret;
-			}
-			gpio_direction_input(add_io.gpio);
-			p_data->io_stats[i].gpio = add_io.gpio;
-
-			//request irq
-			io_irq = gpio_to_irq(add_io.gpio);
-			ret = request_irq(io_irq, pulse_reader_io_interrupt,
-				IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING, "pulse_reader_io_interrupt", p_data);
-			if(ret) {
-				spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-				printk(KERN_ERR "pulse_reader_ioctl ADD_IO can not get irq\n");
-				return ret;
-			}
-			p_data->io_stats[i].irq = io_irq;
-
-			//set filter window size
-			if(add_io.filter_win_size > MAX_FILTER_WINDOW_SIZE)
-				add_io.filter_win_size = MAX_FILTER_WINDOW_SIZE;
-			if(add_io.filter_win_size < MIN_FILTER_WINDOW_SIZE)
-				add_io.filter_win_size = MIN_FILTER_WINDOW_SIZE;
-			p_data->io_stats[i].filter_win_size = add_io.filter_win_size;
-
-			//reset data, this must be called post to gpio_request
-			pulse_reader_stat_reset(&(p_data->io_stats[i]));
-
-			//set used flag
-			p_data->io_stats[i].used = true;
-
-			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+			return pulse_reader_add_io(p_data, add_io.gpio, add_io.filter_win_size);
 		}
 		break;
 	case REMOVE_IO:
 		{
-			uint32_t gpio, i;
+			uint32_t gpio;
 
 			if(copy_from_user(&gpio, (void *)arg, sizeof(uint32_t)))
 				return -EFAULT;
 
-			spin_lock_irqsave(&p_data->rlock, irq_flags);
-
-			for(i=0; i<MAX_IO_NUMBER; i++) {
-				if(p_data->io_stats[i].gpio == gpio
-					&& p_data->io_stats[i].used) {
-					free_irq(p_data->io_stats[i].irq, p_data);
-					gpio_free(p_data->io_stats[i].gpio);
-					p_data->io_stats[i].used = false;
-					break;
-				}
-			}
-			if(i == MAX_IO_NUMBER) {
-				spin_unlock_irqrestore(&p_data->rlock, irq_flags);
-				printk(KERN_ERR "pulse_reader_ioctl io not added %d\n", gpio);
-				return -EFAULT;
-			}
-
-			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+			return pulse_reader_remove_io(p_data, gpio);
 		}
 		break;
 	case SET_CAL_PERIOD:
 		{
-			uint32_t period, i;
+			uint32_t period;
 
 			if(copy_from_user(&period, (void *)arg, sizeof(uint32_t)))
 				return -EFAULT;
 
-			if(period > MAX_CALCULATE_PERIOD)
-				period = MAX_CALCULATE_PERIOD;
-			if(period < MIN_CALCULATE_PERIOD)
-				period = MIN_CALCULATE_PERIOD;
-
-			spin_lock_irqsave(&p_data->rlock, irq_flags);
-			p_data->calculate_period = period;
-			for(i=0; i<MAX_IO_NUMBER; i++)
-				pulse_reader_stat_reset(&p_data->io_stats[i]);
-			hrtimer_cancel(&p_data->pulse_timer);
-			hrtimer_start(&p_data->pulse_timer, ms_to_ktime(p_data->calculate_period), HRTIMER_MODE_REL);
-			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+			pulse_reader_set_cal_period(p_data, period);
 		}
 		break;
 	case GET_IO_STAT:
@@ -470,10 +902,12 @@ static long pulse_reader_ioctl(struct file *file, unsigned int cmd, unsigned lon
 			for(j=0; j<get_io_stat.n_ios; j++) {
 				for(i=0; i<MAX_IO_NUMBER; i++) {
 					p_stat = &(p_data->io_stats[i]);
-					if(p_stat->gpio == get_io_stat.io_stat_user[j].gpio && p_stat->used) {
+					if(p_stat->gpio == get_io_stat.io_stat_user[j].gpio && p_data->io_cfgs[i].used) {
+						spin_lock(&p_stat->lock);
 						if(!p_stat->stopped) {
-							pulse_reader_filter_and_calc(
-								p_stat, &(get_io_stat.io_stat_user[j].duty), &(get_io_stat.io_stat_user[j].cycle));
+							pulse_reader_update_calc(p_stat);
+							get_io_stat.io_stat_user[j].duty = (uint32_t)p_stat->duty;
+							get_io_stat.io_stat_user[j].cycle = (uint32_t)p_stat->cycle;
 #ifdef PULSE_READER_DEBUG
 							printk(KERN_DEBUG "pulse_reader_ioctl gpio=%u, duty=%u, cycle=%u\n",
 								p_stat->gpio, get_io_stat.io_stat_user[j].duty, get_io_stat.io_stat_user[j].cycle);
@@ -482,6 +916,7 @@ static long pulse_reader_ioctl(struct file *file, unsigned int cmd, unsigned lon
 							get_io_stat.io_stat_user[j].duty = 0;
 							get_io_stat.io_stat_user[j].cycle = 0;
 						}
+						spin_unlock(&p_stat->lock);
 						break;
 					}
 				}
@@ -492,6 +927,73 @@ static long pulse_reader_ioctl(struct file *file, unsigned int cmd, unsigned lon
 				return -EFAULT;
 		}
 		break;
+	case GET_IO_STAT_EXT:
+		{
+			uint32_t i, j, usize;
+			int ret;
+			io_stat_t *p_stat;
+			get_io_stat_ext_t req;
+			io_stat_ext_t stats[MAX_IO_NUMBER];
+			ktime_t t_current;
+
+			if(get_user(usize, (uint32_t __user *)arg))
+				return -EFAULT;
+			ret = copy_struct_from_user(&req, sizeof(req), (void __user *)arg, usize);
+			if(ret)
+				return ret;
+			//reserved must be 0 so it can be given a meaning later, and
+			//stat_size is bounded so the tail clear_user stays small
+			if(req.n_ios > MAX_IO_NUMBER || req.reserved
+				|| req.stat_size < offsetofend(io_stat_ext_t, gpio)
+				|| req.stat_size > PAGE_SIZE)
+				return -EINVAL;
+
+			memset(stats, 0, sizeof(stats));
+			for(j=0; j<req.n_ios; j++) {
+				if(get_user(stats[j].gpio,
+					(uint32_t __user *)u64_to_user_ptr(req.stats + (u64)j * req.stat_size)))
+					return -EFAULT;
+			}
+
+			t_current = pulse_reader_get_time();
+			spin_lock_irqsave(&p_data->rlock, irq_flags);
+			for(j=0; j<req.n_ios; j++) {
+				for(i=0; i<MAX_IO_NUMBER; i++) {
+					p_stat = &(p_data->io_stats[i]);
+					if(p_stat->gpio != stats[j].gpio || !p_data->io_cfgs[i].used)
+						continue;
+					spin_lock(&p_stat->lock);
+					if(p_stat->stopped) {
+						stats[j].flags = IO_STAT_STOPPED;
+					} else {
+						pulse_reader_update_calc(p_stat);
+						stats[j].duty = p_stat->duty;
+						stats[j].cycle = p_stat->cycle;
+						stats[j].duty_ratio = p_stat->duty_ratio;
+						stats[j].frequency = p_stat->frequency;
+						stats[j].n_samples = p_stat->n_samples;
+						stats[j].age = ktime_to_ns(ktime_sub(t_current, p_stat->edge_time));
+					}
+					spin_unlock(&p_stat->lock);
+					break;
+				}
+				if(i == MAX_IO_NUMBER)
+					stats[j].flags = IO_STAT_NOT_FOUND;
+			}
+			spin_unlock_irqrestore(&p_data->rlock, irq_flags);
+
+			for(j=0; j<req.n_ios; j++) {
+				void __user *dst = u64_to_user_ptr(req.stats + (u64)j * req.stat_size);
+
+				if(copy_to_user(dst, &stats[j], min_t(size_t, req.stat_size, sizeof(io_stat_ext_t))))
+					return -EFAULT;
+				//newer caller, zero the fields this driver doesn't know
+				if(req.stat_size > sizeof(io_stat_ext_t)
+					&& clear_user(dst + sizeof(io_stat_ext_t), req.stat_size - sizeof(io_stat_ext_t)))
+					return -EFAULT;
+			}
+		}
+		break;
 
 	default:
 		return 0;
@@ -507,10 +1009,52 @@ static const struct file_operations pulse_reader_fops = {
 	.release = pulse_reader_release,
 };
 
+//channels from a "pulse-reader" device tree node (see pulse-reader-overlay.dts)
+//and from the channels module parameter, so capture runs before any reader opens
+static void pulse_reader_add_boot_channels(struct pulse_reader_data_t *p_data)
+{
+	struct device_node *np;
+	uint32_t gpio, filter_win_size, period;
+	int i, n;
+
+	np = of_find_compatible_node(NULL, NULL, "raspberrypi,pulse-reader");
+	if(np) {
+		if(!of_property_read_u32(np, "calculate-period", &period))
+			pulse_reader_set_cal_period(p_data, period);
+		//gpios are phandle + offset, resolved to the kernel gpio number here
+		n = of_count_phandle_with_args(np, "gpios", "#gpio-cells");
+		for(i=0; i<n; i++) {
+			int ret = of_get_named_gpio(np, "gpios", i);
+
+			if(ret < 0) {
+				printk(KERN_ERR "pulse_reader_init can not get device tree gpio %d: %d\n", i, ret);
+				continue;
+			}
+			gpio = ret;
+			if(of_property_read_u32_index(np, "filter-win-sizes", i, &filter_win_size))
+				filter_win_size = DEFALT_FILTER_WINDOW_SIZE;
+			if(pulse_reader_add_io(p_data, gpio, filter_win_size))
+				printk(KERN_ERR "pulse_reader_init can not add device tree gpio %u\n", gpio);
+		}
+		of_node_put(np);
+	}
+
+	for(i=0; i<n_channels; i++) {
+		filter_win_size = DEFALT_FILTER_WINDOW_SIZE;
+		if(sscanf(channels[i], "%u:%u", &gpio, &filter_win_size) < 1) {
+			printk(KERN_ERR "pulse_reader_init bad channel %s\n", channels[i]);
+			continue;
+		}
+		if(pulse_reader_add_io(p_data, gpio, filter_win_size))
+			printk(KERN_ERR "pulse_reader_init can not add gpio %u\n", gpio);
+	}
+}
+
 int pulse_reader_init(void)
 {
-	int err, result = -1;
+	int err, i, result = -1;
 	dev_t devno;
+	struct pulse_reader_data_t *p_data;
 
 	// Allocate a dynamic major number
     result = alloc_chrdev_region(&devno, 0, 1, "pulse_reader");
@@ -525,6 +1069,12 @@ int pulse_reader_init(void)
 	printk(KERN_DEBUG  "pulse_reader_init dev num major=%d, minor=%d\n",
 		pulse_reader_major, pulse_reader_minor);
 
+	//the parameter is read-only, fix it up once so it shows the clock in use
+	if(ts_clock > TS_CLOCK_MONOTONIC_FAST) {
+		printk(KERN_WARNING "pulse_reader_init invalid ts_clock %u, using monotonic\n", ts_clock);
+		ts_clock = TS_CLOCK_MONOTONIC;
+	}
+
 	pulse_reader_class = class_create("pulse_reader");
 	if (IS_ERR(pulse_reader_class)) {
 		result = PTR_ERR(pulse_reader_class);
@@ -532,37 +1082,47 @@ int pulse_reader_init(void)
 		goto fail_create_class;
 	}
 
-	// need to check the result of device_create
-	device_create(pulse_reader_class, NULL,
-		MKDEV(pulse_reader_major, pulse_reader_minor), NULL, "pulse_reader");
-
-	pulse_reader_data = kmalloc(sizeof(struct pulse_reader_data_t), GFP_KERNEL);
-	if (!pulse_reader_data)
+	//fully set up the data before publishing it, open and the sysfs
+	//handlers find it through pulse_reader_data
+	p_data = kzalloc(sizeof(struct pulse_reader_data_t), GFP_KERNEL);
+	if (!p_data)
 	{
 		result = -ENOMEM;
 		printk(KERN_ERR "pulse_reader_init kmalloc failed\n");
 		goto fail_malloc;
 	}
-	memset(pulse_reader_data, 0, sizeof(struct pulse_reader_data_t));
-
-	spin_lock_init(&pulse_reader_data->rlock);
-	pulse_reader_data->calculate_period = DEFALT_CALCULATE_PERIOD;//default period is 10ms
-	hrtimer_init(&pulse_reader_data->pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	pulse_reader_data->pulse_timer.function = pulse_reader_timer_cb;
-	hrtimer_start(&pulse_reader_data->pulse_timer,
-		ms_to_ktime(pulse_reader_data->calculate_period), HRTIMER_MODE_REL);
-
-	cdev_init(&pulse_reader_data->cdev, &pulse_reader_fops);
-	pulse_reader_data->cdev.owner = THIS_MODULE;
-	pulse_reader_data->cdev.ops = &pulse_reader_fops;
-	err = cdev_add(&pulse_reader_data->cdev, devno, 1);
+
+	spin_lock_init(&p_data->rlock);
+	for (i = 0; i < MAX_IO_NUMBER; i++)
+		spin_lock_init(&p_data->io_stats[i].lock);
+	//default period is 10ms
+	p_data->calculate_period = clamp_t(uint32_t, calculate_period,
+		MIN_CALCULATE_PERIOD, MAX_CALCULATE_PERIOD);
+	hrtimer_init(&p_data->pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	p_data->pulse_timer.function = pulse_reader_timer_cb;
+	hrtimer_start(&p_data->pulse_timer,
+		ms_to_ktime(p_data->calculate_period), HRTIMER_MODE_REL);
+
+	cdev_init(&p_data->cdev, &pulse_reader_fops);
+	p_data->cdev.owner = THIS_MODULE;
+	p_data->cdev.ops = &pulse_reader_fops;
+	pulse_reader_data = p_data;
+
+	err = cdev_add(&p_data->cdev, devno, 1);
 	if (err)
 		printk(KERN_ERR "pulse_reader_setup_cdev Error %d adding CDEV%d", err, 0);
 
+	//sysfs last, its files are writable as soon as they appear
+	pulse_reader_device = device_create_with_groups(pulse_reader_class, NULL,
+		MKDEV(pulse_reader_major, pulse_reader_minor), NULL, pulse_reader_groups, "pulse_reader");
+	if (IS_ERR(pulse_reader_device))
+		pulse_reader_device = NULL;
+
+	pulse_reader_add_boot_channels(p_data);
+
 	return 0;
 
 fail_malloc:
-	device_destroy(pulse_reader_class, devno);
 	class_destroy(pulse_reader_class);
 fail_create_class:
 	unregister_chrdev_region(devno, 1);
@@ -573,14 +1133,22 @@ void pulse_reader_exit(void)
 {
     dev_t devno = MKDEV(pulse_reader_major, pulse_reader_minor);
 
+    //remove sysfs first, device_destroy waits for running add_io/remove_io
+    //and gpioN handlers, so the channels below can't change any more
+    if (pulse_reader_class)
+        device_destroy(pulse_reader_class, devno);
+    pulse_reader_device = NULL;
+
     if (pulse_reader_data) {
         int i;
         hrtimer_cancel(&pulse_reader_data->pulse_timer);
         for (i = 0; i < MAX_IO_NUMBER; i++) {
-            io_stat_t *p_stat = &(pulse_reader_data->io_stats[i]);
-            if (p_stat->used) {
-                free_irq(p_stat->irq, pulse_reader_data);
-                gpio_free(p_stat->gpio);
+            io_cfg_t *p_cfg = &(pulse_reader_data->io_cfgs[i]);
+            if (p_cfg->used) {
+                if (p_cfg->kobj)
+                    kobject_put(p_cfg->kobj);
+                free_irq(p_cfg->irq, &(pulse_reader_data->io_stats[i]));
+                gpio_free(pulse_reader_data->io_stats[i].gpio);
             }
         }
 
@@ -590,9 +1158,9 @@ void pulse_reader_exit(void)
     }
 
     if (pulse_reader_class) {
-		device_destroy(pulse_reader_class, devno);
         class_destroy(pulse_reader_class);
         pulse_reader_class = NULL;
+        pulse_reader_device = NULL;
     }
 
     unregister_chrdev_region(devno, 1);
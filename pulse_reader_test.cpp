@@ -5,53 +5,259 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 
-typedef unsigned int uint32_t;
-
-#define	ADD_IO				0x7B01
-#define	REMOVE_IO			0x7B02
-#define	SET_CAL_PERIOD	0x7B03//set period in ms
-#define	GET_IO_STAT		0x7B04
-
-#define	MAX_IO_NUMBER	10
+#include "pulse_reader.h"
 
 #define GPIO_25	25
 #define GPIO_26	26
 
+//gpio-sim device used by the benchmark, see README
+#define	BENCH_SIM_CONFIGFS	"/sys/kernel/config/gpio-sim/pulse_reader_bench"
+#define	BENCH_RUN_MS		2000
+#define	BENCH_WARMUP_MS	300
+#define	BENCH_SAMPLE_MS	20
+#define	BENCH_SAT_MS		3000
+
 typedef struct
 {
-	uint32_t gpio;
-	uint32_t filter_win_size;
-} add_io_t;
+	uint32_t duty;//in us
+	uint32_t cycle;//in us
+} bench_signal_t;
+
+static const bench_signal_t bench_signals[] = {
+	{1000, 20000},
+	{1500, 20000},
+	{2000, 20000},
+	{500, 1000},
+};
 
 typedef struct
 {
-	uint32_t gpio;
-	uint32_t duty;
-	uint32_t cycle;
-} io_stat_user_t;
+	int pull_fd;
+	bench_signal_t signal;
+	volatile bool running;
+	uint64_t cpu_ns;//generator's own cpu time, excluded from backend cost
+} bench_gen_t;
+
+static uint64_t bench_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+//irq + softirq time of all cpus from /proc/stat, in ms
+//only meaningful with CONFIG_IRQ_TIME_ACCOUNTING
+static uint64_t bench_irq_ms(void)
+{
+	unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+	FILE *fp = fopen("/proc/stat", "r");
+
+	if(!fp)
+		return 0;
+	if(fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu",
+		&user, &nice, &sys, &idle, &iowait, &irq, &softirq) != 7)
+		irq = softirq = 0;
+	fclose(fp);
+	return (irq + softirq) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+static bool bench_read_attr(const char *path, char *buf, size_t len)
+{
+	FILE *fp = fopen(path, "r");
+
+	if(!fp || !fgets(buf, len, fp)) {
+		if(fp)
+			fclose(fp);
+		printf("Error read %s\n", path);
+		return false;
+	}
+	fclose(fp);
+	buf[strcspn(buf, "\n")] = 0;
+	return true;
+}
+
+static void *bench_gen_thread(void *arg)
+{
+	bench_gen_t *gen = (bench_gen_t *)arg;
+	struct timespec next;
+	uint64_t cpu_start = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(gen->running) {
+		pwrite(gen->pull_fd, "pull-up", 7, 0);
+		bench_add_ns(&next, gen->signal.duty * 1000ULL);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		pwrite(gen->pull_fd, "pull-down", 9, 0);
+		bench_add_ns(&next, (gen->signal.cycle - gen->signal.duty) * 1000ULL);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	gen->cpu_ns = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+	return NULL;
+}
 
 typedef struct
 {
-	io_stat_user_t io_stat_user[MAX_IO_NUMBER];
-	uint32_t n_ios;
-} get_io_stat_t;
+	int pull_fd;
+	volatile bool running;
+	uint64_t edges;//edges written, read after join
+} bench_sat_gen_t;
+
+//toggle the line as fast as sysfs allows
+static void *bench_sat_thread(void *arg)
+{
+	bench_sat_gen_t *gen = (bench_sat_gen_t *)arg;
+
+	while(gen->running) {
+		if(pwrite(gen->pull_fd, "pull-up", 7, 0) > 0)
+			gen->edges++;
+		if(pwrite(gen->pull_fd, "pull-down", 9, 0) > 0)
+			gen->edges++;
+	}
+	return NULL;
+}
+
+//add the edges counted since the last read, n_samples below the previous
+//read or a stopped channel means the driver reset it after a 30ms gap
+static int bench_sat_count(pulse_reader_t *reader, io_stat_ext_t *stats, uint32_t n,
+	uint64_t *last, uint64_t *counted, uint32_t *resets)
+{
+	uint32_t j;
+
+	if(pulse_reader_get_io_stat_ext(reader, stats, n) == -1)
+		return -1;
+	for(j=0; j<n; j++) {
+		if((stats[j].flags & IO_STAT_STOPPED) || stats[j].n_samples < last[j]) {
+			(*resets)++;
+			last[j] = 0;
+		}
+		//two edges per counted pulse
+		*counted += (stats[j].n_samples - last[j]) * 2;
+		last[j] = stats[j].n_samples;
+	}
+	return 0;
+}
+
+//run every bench signal through one backend and print error and cpu cost
+static int bench_backend(int backend, const char *chip, uint32_t gpio, int pull_fd)
+{
+	pulse_reader_t *reader;
+	add_io_t add_io;
+	uint32_t s, n;
+
+	reader = pulse_reader_open(backend, chip);
+	if(!reader) {
+		printf("Error open backend %s\n", backend == PULSE_READER_BACKEND_KERNEL ? "kernel" : "gpiod");
+		return -1;
+	}
+	add_io.gpio = gpio;
+	add_io.filter_win_size = 5;
+	if(pulse_reader_add_io(reader, &add_io) == -1) {
+		pulse_reader_close(reader);
+		printf("Error add io %u\n", gpio);
+		return -1;
+	}
+
+	for(s=0; s<sizeof(bench_signals)/sizeof(bench_signals[0]); s++) {
+		bench_gen_t gen;
+		pthread_t thread;
+		uint64_t cpu_start, irq_start, cpu_ns, irq_ms;
+		double duty_err = 0, cycle_err = 0, duty_max = 0;
+		double duty_sum = 0, duty_sq = 0, cycle_sum = 0, cycle_sq = 0;
+		double duty_avg = 0, duty_sd = 0, cycle_avg = 0, cycle_sd = 0;
+		uint32_t valid = 0, failed = 0;
+
+		gen.pull_fd = pull_fd;
+		gen.signal = bench_signals[s];
+		gen.running = true;
+		gen.cpu_ns = 0;
+		pthread_create(&thread, NULL, bench_gen_thread, &gen);
+		usleep(BENCH_WARMUP_MS * 1000);
+
+		cpu_start = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		irq_start = bench_irq_ms();
+		for(n=0; n<BENCH_RUN_MS/BENCH_SAMPLE_MS; n++) {
+			get_io_stat_t io_stat;
+			double duty, cycle, err;
+
+			io_stat.io_stat_user[0].gpio = gpio;
+			io_stat.n_ios = 1;
+			usleep(BENCH_SAMPLE_MS * 1000);
+			//failed reads and stopped channels (cycle 0) are counted, not averaged
+			if(pulse_reader_get_io_stat(reader, &io_stat) == -1
+				|| io_stat.io_stat_user[0].cycle == 0) {
+				failed++;
+				continue;
+			}
+			duty = io_stat.io_stat_user[0].duty / 1000.0;
+			cycle = io_stat.io_stat_user[0].cycle / 1000.0;
+			duty_sum += duty;
+			duty_sq += duty * duty;
+			cycle_sum += cycle;
+			cycle_sq += cycle * cycle;
+			err = fabs(duty - gen.signal.duty);
+			duty_err += err;
+			if(err > duty_max)
+				duty_max = err;
+			cycle_err += fabs(cycle - gen.signal.cycle);
+			valid++;
+		}
+		gen.running = false;
+		pthread_join(thread, NULL);
+		cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - gen.cpu_ns;
+		irq_ms = bench_irq_ms() - irq_start;
+
+		if(valid) {
+			duty_avg = duty_sum / valid;
+			duty_sd = sqrt(fmax(duty_sq / valid - duty_avg * duty_avg, 0));
+			cycle_avg = cycle_sum / valid;
+			cycle_sd = sqrt(fmax(cycle_sq / valid - cycle_avg * cycle_avg, 0));
+			duty_err /= valid;
+			cycle_err /= valid;
+		}
 
+		printf("%-6s duty=%5u cycle=%5u: samples=%u failed=%u, duty avg=%.1fus sd=%.1fus err avg=%.1fus max=%.0fus, "
+			"cycle avg=%.1fus sd=%.1fus err avg=%.1fus, cpu=%.1fms irq=%llums\n",
+			backend == PULSE_READER_BACKEND_KERNEL ? "kernel" : "gpiod",
+			gen.signal.duty, gen.signal.cycle, valid, failed,
+			duty_avg, duty_sd, duty_err, duty_max,
+			cycle_avg, cycle_sd, cycle_err,
+			cpu_ns / 1e6, (unsigned long long)irq_ms);
+	}
+
+	pulse_reader_remove_io(reader, gpio);
+	pulse_reader_close(reader);
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
-	int fd, i;
+	pulse_reader_t *reader;
+	int i;
 	unsigned int period, gpio;
 	add_io_t add_io;
 
-	fd = open("/dev/pulse_reader", O_RDWR);
-	if (fd < 0) {
+	reader = pulse_reader_open(PULSE_READER_BACKEND_AUTO, NULL);
+	if (!reader) {
 		printf("Error open\n");
 		return 0;
 	}
+	printf("using %s backend\n",
+		pulse_reader_backend(reader) == PULSE_READER_BACKEND_KERNEL ? "kernel" : "gpiod");
 
-	if(argc != 2)
+	if(argc < 2)
 		return 0;
 
 	switch(argv[1][0])
@@ -61,8 +267,8 @@ int main(int argc, char **argv)
 			//test set period
 			printf("ioctl SET_CAL_PERIOD 10ms\n");
 			period = 10;
-			if (ioctl(fd, SET_CAL_PERIOD, &period) == -1) {
-				close(fd);
+			if (pulse_reader_set_cal_period(reader, period) == -1) {
+				pulse_reader_close(reader);
 				printf("Error ioctl SET_CAL_PERIOD %d\n", period);
 				return 0;
 			}
@@ -74,30 +280,30 @@ int main(int argc, char **argv)
 			printf("ioctl ADD_IO GPIO_25\n");
 			add_io.gpio = GPIO_25;
 			add_io.filter_win_size = 5;
-			if (ioctl(fd, ADD_IO, &add_io) == -1) {
-				close(fd);
+			if (pulse_reader_add_io(reader, &add_io) == -1) {
+				pulse_reader_close(reader);
 				printf("Error ioctl ADD_IO GPIO_25\n");
 				return 0;
 			}
 			printf("ioctl ADD_IO GPIO_26\n");
 			add_io.gpio = GPIO_26;
 			add_io.filter_win_size = 3;
-			if (ioctl(fd, ADD_IO, &add_io) == -1) {
-				close(fd);
+			if (pulse_reader_add_io(reader, &add_io) == -1) {
+				pulse_reader_close(reader);
 				printf("Error ioctl ADD_IO GPIO_26\n");
 				return 0;
 			}
 			printf("ioctl REMOVE_IO GPIO_25\n");
 			gpio = GPIO_25;
-			if (ioctl(fd, REMOVE_IO, &gpio) == -1) {
-				close(fd);
+			if (pulse_reader_remove_io(reader, gpio) == -1) {
+				pulse_reader_close(reader);
 				printf("Error ioctl REMOVE_IO GPIO_25\n");
 				return 0;
 			}
 			printf("ioctl REMOVE_IO GPIO_26\n");
 			gpio = GPIO_26;
-			if (ioctl(fd, REMOVE_IO, &gpio) == -1) {
-				close(fd);
+			if (pulse_reader_remove_io(reader, gpio) == -1) {
+				pulse_reader_close(reader);
 				printf("Error ioctl REMOVE_IO GPIO_26\n");
 				return 0;
 			}
@@ -109,16 +315,16 @@ int main(int argc, char **argv)
 		printf("ioctl ADD_IO GPIO_25\n");
 		add_io.gpio = GPIO_25;
 		add_io.filter_win_size = 5;
-		if (ioctl(fd, ADD_IO, &add_io) == -1) {
-			close(fd);
+		if (pulse_reader_add_io(reader, &add_io) == -1) {
+			pulse_reader_close(reader);
 			printf("Error ioctl ADD_IO GPIO_25\n");
 			return 0;
 		}
 		printf("ioctl ADD_IO GPIO_26\n");
 		add_io.gpio = GPIO_26;
 		add_io.filter_win_size = 3;
-		if (ioctl(fd, ADD_IO, &add_io) == -1) {
-			close(fd);
+		if (pulse_reader_add_io(reader, &add_io) == -1) {
+			pulse_reader_close(reader);
 			printf("Error ioctl ADD_IO GPIO_26\n");
 			return 0;
 		}
@@ -128,7 +334,7 @@ int main(int argc, char **argv)
 			io_stat.io_stat_user[0].gpio = GPIO_25;
 			io_stat.io_stat_user[1].gpio = GPIO_26;
 			io_stat.n_ios = 2;
-			if (ioctl(fd, GET_IO_STAT, &io_stat) == -1) {
+			if (pulse_reader_get_io_stat(reader, &io_stat) == -1) {
 				printf("Error ioctl GET_IO_STAT\n");
 				return 0;
 			}
@@ -140,24 +346,194 @@ int main(int argc, char **argv)
 		}
 		printf("ioctl REMOVE_IO GPIO_25\n");
 		gpio = GPIO_25;
-		if (ioctl(fd, REMOVE_IO, &gpio) == -1) {
-			close(fd);
+		if (pulse_reader_remove_io(reader, gpio) == -1) {
+			pulse_reader_close(reader);
 			printf("Error ioctl REMOVE_IO GPIO_25\n");
 			return 0;
 		}
 		printf("ioctl REMOVE_IO GPIO_26\n");
 		gpio = GPIO_26;
-		if (ioctl(fd, REMOVE_IO, &gpio) == -1) {
-			close(fd);
+		if (pulse_reader_remove_io(reader, gpio) == -1) {
+			pulse_reader_close(reader);
 			printf("Error ioctl REMOVE_IO GPIO_26\n");
 			return 0;
 		}
 	}
+		break;
+	case '3':
+	{
+		//compare kernel module and gpiod backend on a gpio-sim line
+		//usage: pulse_reader_test 3 <kernel gpio number of sim line 0>
+		char path[256], dev_name[64], chip_name[64];
+		int pull_fd;
+
+		if(argc != 3) {
+			printf("usage: %s 3 <kernel gpio number of sim line 0>\n", argv[0]);
+			break;
+		}
+		//the bench backends request the line themselves
+		pulse_reader_close(reader);
+		reader = NULL;
+
+		if(!bench_read_attr(BENCH_SIM_CONFIGFS "/dev_name", dev_name, sizeof(dev_name))
+			|| !bench_read_attr(BENCH_SIM_CONFIGFS "/bank0/chip_name", chip_name, sizeof(chip_name)))
+			return 0;
+		snprintf(path, sizeof(path), "/sys/devices/platform/%s/%s/sim_gpio0/pull", dev_name, chip_name);
+		pull_fd = open(path, O_WRONLY);
+		if(pull_fd < 0) {
+			printf("Error open %s\n", path);
+			return 0;
+		}
+
+		bench_backend(PULSE_READER_BACKEND_KERNEL, NULL, atoi(argv[2]), pull_fd);
+		snprintf(path, sizeof(path), "/dev/%s", chip_name);
+		bench_backend(PULSE_READER_BACKEND_GPIOD, path, atoi(argv[2]), pull_fd);
+		close(pull_fd);
+	}
+		break;
+	case '4':
+	{
+		//aggregate edge throughput of the given gpios, driven externally
+		//usage: pulse_reader_test 4 <gpio> [<gpio> ...]
+		io_stat_ext_t stats[MAX_IO_NUMBER];
+		uint64_t last[MAX_IO_NUMBER] = {0}, t_last, t_now;
+		uint32_t n_ios = 0, j;
+
+		for(j=2; j<(uint32_t)argc && n_ios<MAX_IO_NUMBER; j++) {
+			add_io.gpio = atoi(argv[j]);
+			add_io.filter_win_size = 3;
+			if (pulse_reader_add_io(reader, &add_io) == -1) {
+				pulse_reader_close(reader);
+				printf("Error ioctl ADD_IO %u\n", add_io.gpio);
+				return 0;
+			}
+			stats[n_ios++].gpio = add_io.gpio;
+		}
+
+		t_last = bench_clock_ns(CLOCK_MONOTONIC);
+		for(i=0; i<10; i++) {
+			uint64_t total = 0;
+
+			sleep(1);
+			if (pulse_reader_get_io_stat_ext(reader, stats, n_ios) == -1) {
+				printf("Error ioctl GET_IO_STAT_EXT\n");
+				break;
+			}
+			t_now = bench_clock_ns(CLOCK_MONOTONIC);
+			for(j=0; j<n_ios; j++) {
+				//a channel that stopped restarts its count
+				if(stats[j].n_samples >= last[j])
+					total += stats[j].n_samples - last[j];
+				last[j] = stats[j].n_samples;
+			}
+			//two edges per counted pulse
+			printf("%u ios: %.0f edges/s\n", n_ios, total * 2 * 1e9 / (t_now - t_last));
+			t_last = t_now;
+		}
+
+		for(j=0; j<n_ios; j++)
+			pulse_reader_remove_io(reader, stats[j].gpio);
+	}
+		break;
+	case '5':
+	{
+		//drive 1 to <lines> gpio-sim lines as fast as possible and compare the
+		//generated edges with the ones the backend counted, loss shows saturation
+		//usage: pulse_reader_test 5 <kernel gpio number of sim line 0> <lines>
+		char path[256], dev_name[64], chip_name[64];
+		bench_sat_gen_t gens[MAX_IO_NUMBER];
+		pthread_t threads[MAX_IO_NUMBER];
+		io_stat_ext_t stats[MAX_IO_NUMBER];
+		uint32_t base, n_lines, n, j;
+
+		if(argc != 4) {
+			printf("usage: %s 5 <kernel gpio number of sim line 0> <lines>\n", argv[0]);
+			break;
+		}
+		base = atoi(argv[2]);
+		n_lines = atoi(argv[3]);
+		if(n_lines < 1 || n_lines > MAX_IO_NUMBER) {
+			printf("lines must be 1 to %d\n", MAX_IO_NUMBER);
+			break;
+		}
+		if(!bench_read_attr(BENCH_SIM_CONFIGFS "/dev_name", dev_name, sizeof(dev_name))
+			|| !bench_read_attr(BENCH_SIM_CONFIGFS "/bank0/chip_name", chip_name, sizeof(chip_name)))
+			return 0;
+
+		for(j=0; j<n_lines; j++) {
+			snprintf(path, sizeof(path), "/sys/devices/platform/%s/%s/sim_gpio%u/pull", dev_name, chip_name, j);
+			gens[j].pull_fd = open(path, O_WRONLY);
+			if(gens[j].pull_fd < 0) {
+				printf("Error open %s\n", path);
+				return 0;
+			}
+			pwrite(gens[j].pull_fd, "pull-down", 9, 0);
+			//no filter, every edge is counted
+			add_io.gpio = base + j;
+			add_io.filter_win_size = 1;
+			if (pulse_reader_add_io(reader, &add_io) == -1) {
+				pulse_reader_close(reader);
+				printf("Error ioctl ADD_IO %u\n", add_io.gpio);
+				return 0;
+			}
+		}
+
+		for(n=1; n<=n_lines; n++) {
+			uint64_t generated = 0, counted = 0, last[MAX_IO_NUMBER] = {0}, t_start, t_run;
+			uint32_t resets = 0, t;
+			int ret = 0;
+
+			//let the channels time out so n_samples starts from 0
+			usleep(100 * 1000);
+			for(j=0; j<n; j++)
+				stats[j].gpio = base + j;
+			t_start = bench_clock_ns(CLOCK_MONOTONIC);
+			for(j=0; j<n; j++) {
+				gens[j].running = true;
+				gens[j].edges = 0;
+				pthread_create(&threads[j], NULL, bench_sat_thread, &gens[j]);
+			}
+			//sample faster than the 30ms timeout so a reset is seen, not
+			//taken for lost edges
+			for(t=0; t<BENCH_SAT_MS/BENCH_SAMPLE_MS && !ret; t++) {
+				usleep(BENCH_SAMPLE_MS * 1000);
+				ret = bench_sat_count(reader, stats, n, last, &counted, &resets);
+			}
+			for(j=0; j<n; j++)
+				gens[j].running = false;
+			for(j=0; j<n; j++) {
+				pthread_join(threads[j], NULL);
+				generated += gens[j].edges;
+			}
+			t_run = bench_clock_ns(CLOCK_MONOTONIC) - t_start;
+			//read the tail before the channels time out
+			if(!ret)
+				ret = bench_sat_count(reader, stats, n, last, &counted, &resets);
+			if(ret) {
+				printf("Error ioctl GET_IO_STAT_EXT\n");
+				break;
+			}
+
+			printf("%u lines: generated %.0f edges/s, counted %.0f edges/s, lost %.1f%%",
+				n, generated * 1e9 / t_run, counted * 1e9 / t_run,
+				generated ? 100.0 * ((double)generated - (double)counted) / generated : 0.0);
+			//a generator stalled for 30ms, the edges around it are not counted
+			if(resets)
+				printf(", %u channel resets, run not valid", resets);
+			printf("\n");
+		}
+
+		for(j=0; j<n_lines; j++) {
+			pulse_reader_remove_io(reader, base + j);
+			close(gens[j].pull_fd);
+		}
+	}
+		break;
 	default:
 		break;
 	}
 
-	close(fd);
+	pulse_reader_close(reader);
 	
 	return 0;
 }